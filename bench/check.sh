@@ -0,0 +1,68 @@
+#!/bin/bash
+
+# Checks that the pages don't depend on the number of threads, on the
+# sharding or on the scheduling, on a small synthetic corpus
+#
+# call: bench/check.sh [DOXY2MAN]
+#
+# Compares -j 1 with -j 4, the union of the --shard I/3 runs with an
+# unsharded run and the tar files of several runs with each other and
+# with the output directory.
+
+doxy2man="$1"
+: ${doxy2man:=./doxy2man}
+: ${CHECK_DIR:=bench/check}
+
+set -eu
+
+here=$(dirname "$0")
+flags="--date 2016-08-30 --struct-so --format man,markdown,html,json"
+
+rm -rf "$CHECK_DIR"
+eval "$(python3 "$here"/gen_corpus.py --out "$CHECK_DIR"/xml --headers 6 \
+  --functions 40 --structs 5 --see-density 3 --seed 42)"
+echo "corpus: $functions functions, $structs structs, $bytes bytes"
+xml="$CHECK_DIR"/xml/index.xml
+
+failed=0
+same()
+{
+  local what=$1
+  shift
+  if diff -r "$@" > /dev/null; then
+    echo "ok   $what"
+  else
+    echo "FAIL $what"
+    diff -r "$@" | head -20 || true
+    failed=1
+  fi
+}
+
+d2m()
+{
+  "$doxy2man" $flags "$@" "$xml" > /dev/null
+}
+
+d2m -j 1 -o "$CHECK_DIR"/j1
+d2m -j 4 -o "$CHECK_DIR"/j4
+same "-j 1 vs -j 4" "$CHECK_DIR"/j1 "$CHECK_DIR"/j4
+
+for i in 1 2 3; do
+  d2m -j 2 --shard $i/3 -o "$CHECK_DIR"/shards
+done
+same "--shard I/3 vs unsharded" -x '.doxy2man-manifest*' \
+  "$CHECK_DIR"/j1 "$CHECK_DIR"/shards
+
+d2m -j 1 --tar "$CHECK_DIR"/j1.tar
+d2m -j 4 --tar "$CHECK_DIR"/j4.tar
+"$doxy2man" $flags -j 4 --tar - "$xml" > "$CHECK_DIR"/stdout.tar
+same "tar -j 1 vs -j 4" "$CHECK_DIR"/j1.tar "$CHECK_DIR"/j4.tar
+same "tar file vs stdout" "$CHECK_DIR"/j1.tar "$CHECK_DIR"/stdout.tar
+mkdir "$CHECK_DIR"/untar "$CHECK_DIR"/merged
+tar -xf "$CHECK_DIR"/j1.tar -C "$CHECK_DIR"/untar
+same "tar layout" <(ls "$CHECK_DIR"/untar) <(printf '%s\n' html json man3 markdown)
+cp "$CHECK_DIR"/untar/*/* "$CHECK_DIR"/merged
+same "tar vs output directory" -x '.doxy2man-manifest*' \
+  "$CHECK_DIR"/j1 "$CHECK_DIR"/merged
+
+exit $failed
@@ -0,0 +1,19 @@
+#!/bin/bash
+
+# Runs the roff escaping microbenchmark for each scanner variant, dispatch
+# picks AVX2 at runtime if the CPU supports it
+#
+# call: bench/escape.sh [MB]
+
+set -eu
+
+here=$(dirname "$0")
+: ${CXX:=g++}
+: ${BENCH_DIR:=bench/corpus}
+
+mkdir -p "$BENCH_DIR"
+for v in scalar:-DROFF_ESCAPE_SCALAR sse2:-DROFF_ESCAPE_NO_AVX2 dispatch:; do
+  name=${v%%:*}
+  "$CXX" -O2 ${v#*:} -o "$BENCH_DIR"/escape_$name "$here"/roff_escape_bench.cc
+  "$BENCH_DIR"/escape_$name "$@"
+done
@@ -0,0 +1,254 @@
+#!/usr/bin/env python3
+#
+# Generates a synthetic doxygen XML corpus for benchmarking doxy2man.
+#
+# License: GPLv3+
+#
+
+import argparse
+import os
+import random
+import shutil
+
+WORDS = ('the of and to in is that for it as with on by this be are from at '
+         'or an which connection buffer handle returns value state error '
+         'pointer length flags context request message session timeout '
+         'callback queue entry index default option channel stream').split()
+
+PERMISSIVE_XSD = '''<?xml version='1.0' encoding='utf-8' ?>
+<xsd:schema xmlns:xsd="http://www.w3.org/2001/XMLSchema">
+  <xsd:element name="doxygen">
+    <xsd:complexType>
+      <xsd:sequence>
+        <xsd:any minOccurs="0" maxOccurs="unbounded" processContents="skip"/>
+      </xsd:sequence>
+      <xsd:anyAttribute processContents="skip"/>
+    </xsd:complexType>
+  </xsd:element>
+</xsd:schema>
+'''
+
+HEAD = ('<?xml version=\'1.0\' encoding=\'UTF-8\' standalone=\'no\'?>\n'
+        '<doxygen xmlns:xsi="http://www.w3.org/2001/XMLSchema-instance" '
+        'xsi:noNamespaceSchemaLocation="compound.xsd" version="1.8.11">\n')
+TAIL = '</doxygen>\n'
+
+TYPES = ('int', 'unsigned', 'size_t', 'const char *', 'void *', 'double',
+         'uint32_t', 'long')
+
+
+class Corpus:
+    def __init__(self, args):
+        self.a = args
+        self.rnd = random.Random(args.seed)
+        self.functions = 0
+        self.structs = 0
+        self.bytes = 0
+
+    def text(self, n):
+        return ' '.join(self.rnd.choice(WORDS) for _ in range(n))
+
+    def write(self, name, data):
+        data = data.encode('utf-8')
+        with open(os.path.join(self.a.out, name), 'wb') as f:
+            f.write(data)
+        self.bytes += len(data)
+
+    def struct_id(self, h, s):
+        return 'structs%03d__%03d' % (h, s)
+
+    def struct_name(self, h, s):
+        return 's%03d_%03d' % (h, s)
+
+    def func_name(self, h, i):
+        return 'h%03d_f%04d' % (h, i)
+
+    def func_id(self, h, i):
+        return 'h%03d_8h_1a%032x' % (h, i)
+
+    def gen_struct(self, h, s):
+        a = self.a
+        sid = self.struct_id(h, s)
+        name = self.struct_name(h, s)
+        o = [HEAD]
+        o.append('  <compounddef id="%s" kind="struct" language="C++" '
+                 'prot="public">\n' % sid)
+        o.append('    <compoundname>%s</compoundname>\n' % name)
+        o.append('    <sectiondef kind="public-attrib">\n')
+        for m in range(a.members):
+            t = self.rnd.choice(TYPES)
+            o.append('      <memberdef kind="variable" id="%s_1a%032x" '
+                     'prot="public" static="no" mutable="no">\n' % (sid, m))
+            o.append('        <type>%s</type>\n' % t)
+            o.append('        <definition>%s %s::m%d</definition>\n'
+                     % (t, name, m))
+            o.append('        <argsstring></argsstring>\n')
+            o.append('        <name>m%d</name>\n' % m)
+            o.append('        <briefdescription>\n<para>%s </para>\n'
+                     '        </briefdescription>\n' % self.text(6))
+            o.append('        <detaileddescription>\n'
+                     '        </detaileddescription>\n')
+            o.append('      </memberdef>\n')
+        o.append('    </sectiondef>\n')
+        o.append('    <briefdescription>\n<para>%s </para>\n'
+                 '    </briefdescription>\n' % self.text(8))
+        o.append('    <detaileddescription>\n<para>%s </para>\n'
+                 '    </detaileddescription>\n' % self.text(a.desc_words))
+        o.append('  </compounddef>\n')
+        o.append(TAIL)
+        self.write(sid + '.xml', ''.join(o))
+        self.structs += 1
+
+    def param_type(self, h):
+        a = self.a
+        if a.structs and self.rnd.random() < a.ref_density:
+            s = self.rnd.randrange(a.structs)
+            return ('struct <ref refid="%s" kindref="compound">%s</ref> *'
+                    % (self.struct_id(h, s), self.struct_name(h, s)))
+        return self.rnd.choice(TYPES)
+
+    def gen_function(self, h, i, o):
+        a = self.a
+        name = self.func_name(h, i)
+        rtype = self.rnd.choice(TYPES)
+        params = [(self.param_type(h), 'p%d' % k) for k in range(a.params)]
+        o.append('      <memberdef kind="function" id="%s" prot="public" '
+                 'static="no" const="no" explicit="no" inline="no" '
+                 'virt="non-virtual">\n' % self.func_id(h, i))
+        o.append('        <type>%s</type>\n' % rtype)
+        o.append('        <definition>%s %s</definition>\n' % (rtype, name))
+        o.append('        <argsstring>(%s)</argsstring>\n'
+                 % ', '.join('p%d' % k for k in range(a.params)))
+        o.append('        <name>%s</name>\n' % name)
+        for t, p in params:
+            o.append('        <param>\n          <type>%s</type>\n'
+                     '          <declname>%s</declname>\n        </param>\n'
+                     % (t, p))
+        o.append('        <briefdescription>\n<para>%s </para>\n'
+                 '        </briefdescription>\n' % self.text(10))
+        o.append('        <detaileddescription>\n<para>%s </para>\n'
+                 % self.text(a.desc_words))
+        o.append('<para>')
+        if params:
+            o.append('<parameterlist kind="param">')
+        for _, p in params:
+            o.append('<parameteritem>\n<parameternamelist>\n'
+                     '<parametername direction="in">%s</parametername>\n'
+                     '</parameternamelist>\n<parameterdescription>\n'
+                     '<para>%s </para>\n</parameterdescription>\n'
+                     '</parameteritem>\n' % (p, self.text(8)))
+        if params:
+            o.append('</parameterlist>\n')
+        o.append('<simplesect kind="return"><para>%s </para>\n'
+                 '</simplesect>\n' % self.text(8))
+        n = int(a.see_density)
+        if self.rnd.random() < a.see_density - n:
+            n += 1
+        if n and a.functions > 1:
+            o.append('<simplesect kind="see"><para>')
+            refs = []
+            for _ in range(n):
+                k = self.rnd.randrange(a.functions)
+                refs.append('<ref refid="%s" kindref="member">%s</ref>'
+                            % (self.func_id(h, k), self.func_name(h, k)))
+            o.append(', '.join(refs))
+            o.append('</para></simplesect>\n')
+        o.append('</para>\n        </detaileddescription>\n')
+        o.append('        <inbodydescription>\n'
+                 '        </inbodydescription>\n')
+        o.append('        <location file="h%03d.h" line="%d" column="1"/>\n'
+                 % (h, 10 + i))
+        o.append('      </memberdef>\n')
+        self.functions += 1
+
+    def gen_header(self, h):
+        a = self.a
+        o = [HEAD]
+        o.append('  <compounddef id="h%03d_8h" kind="file" language="C++">\n'
+                 % h)
+        o.append('    <compoundname>h%03d.h</compoundname>\n' % h)
+        for s in range(a.structs):
+            o.append('    <innerclass refid="%s" prot="public">%s'
+                     '</innerclass>\n'
+                     % (self.struct_id(h, s), self.struct_name(h, s)))
+        o.append('    <sectiondef kind="func">\n')
+        for i in range(a.functions):
+            self.gen_function(h, i, o)
+        o.append('    </sectiondef>\n')
+        o.append('    <briefdescription>\n<para>%s </para>\n'
+                 '    </briefdescription>\n' % self.text(8))
+        o.append('    <detaileddescription>\n<para>%s </para>\n'
+                 '    </detaileddescription>\n' % self.text(a.desc_words))
+        o.append('    <location file="h%03d.h"/>\n' % h)
+        o.append('  </compounddef>\n')
+        o.append(TAIL)
+        self.write('h%03d_8h.xml' % h, ''.join(o))
+        for s in range(a.structs):
+            self.gen_struct(h, s)
+
+    def gen_index(self):
+        a = self.a
+        o = ['<?xml version=\'1.0\' encoding=\'UTF-8\' standalone=\'no\'?>\n'
+             '<doxygenindex version="1.8.11">\n']
+        for h in range(a.headers):
+            o.append('  <compound refid="h%03d_8h" kind="file">'
+                     '<name>h%03d.h</name>\n' % (h, h))
+            for i in range(a.functions):
+                o.append('    <member refid="%s" kind="function">'
+                         '<name>%s</name></member>\n'
+                         % (self.func_id(h, i), self.func_name(h, i)))
+            o.append('  </compound>\n')
+            for s in range(a.structs):
+                o.append('  <compound refid="%s" kind="struct">'
+                         '<name>%s</name></compound>\n'
+                         % (self.struct_id(h, s), self.struct_name(h, s)))
+        o.append('</doxygenindex>\n')
+        with open(os.path.join(a.out, 'index.xml'), 'w') as f:
+            f.write(''.join(o))
+
+    def run(self):
+        os.makedirs(self.a.out, exist_ok=True)
+        for h in range(self.a.headers):
+            self.gen_header(h)
+        self.gen_index()
+        xsd = os.path.join(self.a.out, 'compound.xsd')
+        if self.a.xsd:
+            shutil.copyfile(self.a.xsd, xsd)
+        else:
+            with open(xsd, 'w') as f:
+                f.write(PERMISSIVE_XSD)
+
+
+def main():
+    p = argparse.ArgumentParser(
+        description='Generates a synthetic doxygen XML corpus')
+    p.add_argument('--out', default='corpus/xml', help='output directory')
+    p.add_argument('--headers', type=int, default=20)
+    p.add_argument('--functions', type=int, default=200,
+                   help='functions per header')
+    p.add_argument('--params', type=int, default=4,
+                   help='parameters per function')
+    p.add_argument('--structs', type=int, default=10,
+                   help='structs per header')
+    p.add_argument('--members', type=int, default=8,
+                   help='members per struct')
+    p.add_argument('--desc-words', type=int, default=60,
+                   help='words per detailed description')
+    p.add_argument('--ref-density', type=float, default=0.3,
+                   help='fraction of parameters referencing a struct')
+    p.add_argument('--see-density', type=float, default=2.0,
+                   help='see also references per function')
+    p.add_argument('--seed', type=int, default=23)
+    p.add_argument('--xsd', help='compound.xsd to copy, e.g. from a real '
+                   'doxygen run (default: a permissive schema)')
+    args = p.parse_args()
+    c = Corpus(args)
+    c.run()
+    # i.e. eval-able by run.sh
+    print('functions=%d' % c.functions)
+    print('structs=%d' % c.structs)
+    print('bytes=%d' % c.bytes)
+
+
+if __name__ == '__main__':
+    main()
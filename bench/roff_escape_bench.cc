@@ -0,0 +1,243 @@
+/* Microbenchmark of the roff escaping of doxy2man.
+ *
+ * Compares appending description-like text as is with appending it
+ * escaped, the way the page renderer does, i.e. both while copying UTF-8
+ * (through roff_escape.h) and while encoding UTF-16 to UTF-8. Also
+ * checks the result against a byte-by-byte reference.
+ *
+ * call: bench/escape.sh
+ *
+ * License: GPLv3+
+ *
+ */
+
+#include "../roff_escape.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static const char *words[] = {
+  "the", "of", "and", "to", "in", "is", "that", "for", "connection",
+  "buffer", "handle", "returns", "value", "state", "error", "pointer",
+  "length", "flags", "context", "request", "message", "session"
+};
+
+/** Lines of 40 to 120 words, one backslash per about 4 KiB and one
+ *  line in 20 starts with a control character */
+static vector<string> gen_lines(size_t bytes)
+{
+  vector<string> r;
+  srand(23);
+  size_t total = 0;
+  while (total < bytes) {
+    string l;
+    if (rand() % 20 == 0)
+      l += rand() % 2 ? "." : "'";
+    int n = 40 + rand() % 80;
+    for (int i = 0; i < n; ++i) {
+      if (i)
+        l += ' ';
+      l += words[rand() % (sizeof words / sizeof words[0])];
+      if (rand() % 600 == 0)
+        l += "\\n";
+    }
+    total += l.size() + 1;
+    r.push_back(l);
+  }
+  return r;
+}
+
+static string reference(const vector<string> &lines)
+{
+  string r;
+  for (size_t i = 0; i < lines.size(); ++i) {
+    const string &l = lines[i];
+    for (size_t k = 0; k < l.size(); ++k) {
+      if (!k && (l[k] == '.' || l[k] == '\''))
+        r += "\\&";
+      if (l[k] == '\\')
+        r += "\\e";
+      else
+        r += l[k];
+    }
+    r += '\n';
+  }
+  return r;
+}
+
+/** Appends like the renderer, i.e. line by line into a page buffer of
+ *  about page bytes, returns the best time of some rounds */
+template <typename L, typename F>
+static double run(const vector<L> &lines, F f, size_t page,
+    string &out)
+{
+  const int rounds = 10;
+  double best = 1e9;
+  for (int round = 0; round < rounds; ++round) {
+    out.clear();
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (size_t i = 0; i < lines.size(); ++i) {
+      f(lines[i], out);
+      if (out.size() > page)
+        out.clear();
+    }
+    chrono::duration<double> d = chrono::steady_clock::now() - start;
+    if (d.count() < best)
+      best = d.count();
+  }
+  return best;
+}
+
+static void append_plain(const string &l, string &out)
+{
+  out.append(l);
+  out += '\n';
+}
+
+/** As Page_Buffer::append(const QByteArray&) in main.cc, i.e. escapes
+ *  straight from the source */
+static void append_escaped(const string &l, string &out)
+{
+  size_t n = l.size();
+  bool bol = out.empty() || out[out.size() - 1] == '\n';
+  size_t k = roff_find_escape(l.data(), n, bol);
+  out.append(l, 0, k);
+  if (k < n) {
+    size_t old = out.size();
+    bol = !old || out[old - 1] == '\n';
+    out.resize(old + 3 * (n - k));
+    char *e = roff_escape(l.data() + k, n - k, &out[old], bol);
+    out.resize(e - out.data());
+  }
+  out += '\n';
+}
+
+/** As Page_Buffer::append(const QChar*, int) in main.cc, without the
+ *  escaping */
+static void append_utf16(const u16string &l, string &out)
+{
+  size_t old = out.size();
+  size_t n = l.size();
+  const char16_t *p = l.data();
+  out.resize(old + 3 * n + 1);
+  char *d = &out[old];
+  for (size_t i = 0; i < n; ++i) {
+    unsigned c = p[i];
+    if (c < 0x80) {
+      *d++ = c;
+      continue;
+    }
+    if (c < 0x800) {
+      *d++ = 0xc0 | c >> 6;
+    } else if ((c & 0xfc00) == 0xd800 && i + 1 < n
+        && (p[i + 1] & 0xfc00) == 0xdc00) {
+      c = 0x10000 + ((c - 0xd800) << 10) + (p[++i] - 0xdc00);
+      *d++ = 0xf0 | c >> 18;
+      *d++ = 0x80 | (c >> 12 & 0x3f);
+      *d++ = 0x80 | (c >> 6 & 0x3f);
+    } else {
+      *d++ = 0xe0 | c >> 12;
+      *d++ = 0x80 | (c >> 6 & 0x3f);
+    }
+    *d++ = 0x80 | (c & 0x3f);
+  }
+  *d++ = '\n';
+  out.resize(d - out.data());
+}
+
+/** As Page_Buffer::append(const QChar*, int), i.e. escapes while
+ *  encoding */
+static void append_utf16_escaped(const u16string &l, string &out)
+{
+  size_t old = out.size();
+  bool bol = !old || out[old - 1] == '\n';
+  size_t n = l.size();
+  const char16_t *p = l.data();
+  out.resize(old + 3 * n + 1);
+  char *d = &out[old];
+  if (bol && n && p[0] < 0x80 && roff_is_control(p[0])) {
+    *d++ = '\\';
+    *d++ = '&';
+  }
+  for (size_t i = 0; i < n; ++i) {
+    unsigned c = p[i];
+    if (c < 0x80) {
+      if (c == '\\') {
+        *d++ = '\\';
+        *d++ = 'e';
+        continue;
+      }
+      *d++ = c;
+      if (c == '\n' && i + 1 < n && p[i + 1] < 0x80
+          && roff_is_control(p[i + 1])) {
+        *d++ = '\\';
+        *d++ = '&';
+      }
+      continue;
+    }
+    if (c < 0x800) {
+      *d++ = 0xc0 | c >> 6;
+    } else if ((c & 0xfc00) == 0xd800 && i + 1 < n
+        && (p[i + 1] & 0xfc00) == 0xdc00) {
+      c = 0x10000 + ((c - 0xd800) << 10) + (p[++i] - 0xdc00);
+      *d++ = 0xf0 | c >> 18;
+      *d++ = 0x80 | (c >> 12 & 0x3f);
+      *d++ = 0x80 | (c >> 6 & 0x3f);
+    } else {
+      *d++ = 0xe0 | c >> 12;
+      *d++ = 0x80 | (c >> 6 & 0x3f);
+    }
+    *d++ = 0x80 | (c & 0x3f);
+  }
+  *d++ = '\n';
+  out.resize(d - out.data());
+}
+
+int main(int argc, char **argv)
+{
+  size_t mb = argc > 1 ? atoi(argv[1]) : 64;
+  vector<string> lines(gen_lines(mb * 1024 * 1024));
+  string expected(reference(lines));
+
+#if defined(ROFF_ESCAPE_AVX2)
+  const char *variant = roff_has_avx2() ? "avx2" : "sse2";
+#elif defined(ROFF_ESCAPE_SSE2)
+  const char *variant = "sse2";
+#else
+  const char *variant = "scalar";
+#endif
+
+  vector<u16string> lines16;
+  for (size_t i = 0; i < lines.size(); ++i)
+    lines16.push_back(u16string(lines[i].begin(), lines[i].end()));
+
+  string out;
+  out.reserve(expected.size());
+  run(lines, append_escaped, expected.size(), out);
+  bool ok = out == expected;
+  run(lines16, append_utf16_escaped, expected.size(), out);
+  if (!ok || out != expected) {
+    fprintf(stderr, "%s: output differs from the reference\n", variant);
+    return 1;
+  }
+
+  // i.e. a typical page, as the renderer reserves it
+  size_t page = 16 * 1024;
+  double bytes = expected.size();
+  double t_copy = run(lines, append_plain, page, out);
+  double t_copy_esc = run(lines, append_escaped, page, out);
+  double t_utf16 = run(lines16, append_utf16, page, out);
+  double t_utf16_esc = run(lines16, append_utf16_escaped, page, out);
+  printf("%-6s copy  %7.1f MB/s, escaped %7.1f MB/s (%+6.1f %%)\n",
+      variant, bytes / t_copy / 1e6, bytes / t_copy_esc / 1e6,
+      (t_copy_esc / t_copy - 1) * 100);
+  printf("%-6s utf16 %7.1f MB/s, escaped %7.1f MB/s (%+6.1f %%)\n",
+      variant, bytes / t_utf16 / 1e6, bytes / t_utf16_esc / 1e6,
+      (t_utf16_esc / t_utf16 - 1) * 100);
+  return 0;
+}
@@ -0,0 +1,48 @@
+#!/bin/bash
+
+# End-to-end benchmark of doxy2man on a synthetic corpus
+#
+# call: bench/run.sh [DOXY2MAN [GEN_CORPUS_OPTION...]]
+#
+# Each run adds one phase to the previous one, thus the difference of
+# two consecutive runs is the cost of that phase. Extra doxy2man options
+# (e.g. -j 0) can be passed via DOXY2MAN_FLAGS.
+
+doxy2man="$1"
+: ${doxy2man:=./doxy2man}
+shift
+: ${BENCH_DIR:=bench/corpus}
+
+set -eu
+
+here=$(dirname "$0")
+
+rm -rf "$BENCH_DIR"
+eval "$(python3 "$here"/gen_corpus.py --out "$BENCH_DIR"/xml "$@")"
+echo "corpus: $functions functions, $structs structs, $bytes bytes"
+
+prev=0
+run()
+{
+  local phase=$1
+  shift
+  rm -rf "$BENCH_DIR"/out
+  local start end t
+  start=$(date +%s.%N)
+  "$doxy2man" ${DOXY2MAN_FLAGS:-} -o "$BENCH_DIR"/out "$@" \
+    "$BENCH_DIR"/xml/index.xml > /dev/null
+  end=$(date +%s.%N)
+  awk -v p="$phase" -v s="$start" -v e="$end" -v prev="$prev" \
+      -v f="$functions" -v b="$bytes" 'BEGIN {
+    t = e - s
+    printf "%-10s %8.3f s (+%7.3f s) %10.0f functions/s %8.2f MB/s\n",
+      p, t, t - prev, f / t, b / t / 1e6
+  }'
+  prev=$(awk -v s="$start" -v e="$end" 'BEGIN { print e - s }')
+}
+
+run parse      --dump --novalidate --nofollow
+run ref-follow --dump --novalidate
+run validate   --dump
+run render     --dry-run
+run write
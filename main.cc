@@ -14,17 +14,56 @@
 
 #include <QtXml>
 #include <QStack>
-#include <QTextStream>
 #include <QSet>
 #include <QMap>
 #include <QXmlSchema>
 #include <QXmlSchemaValidator>
 #include <QCoreApplication>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QAtomicInt>
+#include <QMutex>
+#include <QThread>
+#include <QBuffer>
+#include <QCryptographicHash>
+#include <QXmlStreamReader>
+#include <QSharedPointer>
+#include <QSocketNotifier>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QWaitCondition>
+#include <QReadWriteLock>
+#include <QThreadStorage>
 
 #include <iostream>
 #include <iomanip>
 #include <algorithm>
 #include <stdexcept>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <cstring>
+
+#include <zlib.h>
+
+#include "roff_escape.h"
+
+#ifdef Q_OS_UNIX
+#include <sys/resource.h>
+#include <time.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#ifdef Q_OS_LINUX
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+#ifdef DOXY2MAN_IO_URING
+#include <errno.h>
+#include <fcntl.h>
+#include <liburing.h>
+#endif
 
 using namespace std;
 
@@ -48,6 +87,344 @@ const char doxy2man::author[] = "Georg Sauthoff";
 const char doxy2man::mail[] = "mail@georg.so";
 const char doxy2man::date[] = "2016-08-30";
 
+/** Handle of an interned string, see String_Pool
+ */
+struct Atom {
+  int id;
+
+  Atom()
+    : id(0)
+  {
+  }
+  explicit Atom(int id)
+    : id(id)
+  {
+  }
+  bool operator==(Atom o) const { return id == o.id; }
+  bool operator!=(Atom o) const { return id != o.id; }
+};
+
+/** Interned UTF-8 strings
+ *
+ * The same few hundred type strings show up again and again in a C API,
+ * thus the model stores them as Atoms. Equal strings get the same
+ * Atom, i.e. comparing them is an integer compare. Their lengths are
+ * cached.
+ *
+ * intern() may be called from several threads. Entries never move,
+ * thus looking up an Atom doesn't need a lock. Nothing is removed
+ * either, except for clear(), which --watch calls between passes.
+ */
+class String_Pool {
+  private:
+    struct Entry {
+      QByteArray utf8;
+      QString str; // for the Roff string helpers
+      int trimmed_size;
+    };
+    enum { BLOCK_SIZE = 4096, MAX_BLOCKS = 4096 };
+    Entry *blocks[MAX_BLOCKS];
+    int count;
+    QHash<QString, int> index;
+    QMutex mutex;
+
+    String_Pool(const String_Pool &);
+    String_Pool &operator=(const String_Pool &);
+
+    const Entry &entry(Atom a) const
+    {
+      return blocks[a.id / BLOCK_SIZE][a.id % BLOCK_SIZE];
+    }
+  public:
+    String_Pool()
+      : count(0)
+    {
+      std::fill(blocks, blocks + MAX_BLOCKS, (Entry*)0);
+      intern(QString()); // i.e. Atom() is the empty string
+    }
+    ~String_Pool()
+    {
+      for (int i = 0; i < MAX_BLOCKS; ++i)
+        delete[] blocks[i];
+    }
+    Atom intern(const QString &s)
+    {
+      QMutexLocker locker(&mutex);
+      QHash<QString, int>::const_iterator i = index.constFind(s);
+      if (i != index.constEnd())
+        return Atom(i.value());
+      int id = count;
+      if (id / BLOCK_SIZE >= MAX_BLOCKS)
+        throw runtime_error("String pool is full");
+      if (!blocks[id / BLOCK_SIZE])
+        blocks[id / BLOCK_SIZE] = new Entry[BLOCK_SIZE];
+      Entry &e = blocks[id / BLOCK_SIZE][id % BLOCK_SIZE];
+      e.utf8 = s.toUtf8();
+      e.str = s;
+      e.str.squeeze();
+      e.trimmed_size = s.trimmed().size();
+      index.insert(e.str, id);
+      ++count;
+      return Atom(id);
+    }
+    const QString &str(Atom a) const
+    {
+      return entry(a).str;
+    }
+    const QByteArray &utf8(Atom a) const
+    {
+      return entry(a).utf8;
+    }
+    size_t size(Atom a) const
+    {
+      return entry(a).str.size();
+    }
+    size_t trimmed_size(Atom a) const
+    {
+      return entry(a).trimmed_size;
+    }
+    int used()
+    {
+      QMutexLocker locker(&mutex);
+      return count;
+    }
+    /** Forgets all strings, i.e. no Atom may be used afterwards */
+    void clear()
+    {
+      {
+        QMutexLocker locker(&mutex);
+        for (int i = 0; i < MAX_BLOCKS; ++i) {
+          delete[] blocks[i];
+          blocks[i] = 0;
+        }
+        index.clear();
+        count = 0;
+      }
+      intern(QString());
+    }
+};
+
+String_Pool atoms;
+
+ostream &operator<<(ostream &o, Atom a)
+{
+  o << atoms.utf8(a).data();
+  return o;
+}
+
+// operator new calls, only counted with --stats
+static bool count_new_calls;
+static qint64 new_calls;
+
+#if __cplusplus < 201103L
+void *operator new(size_t n) throw(std::bad_alloc)
+#else
+void *operator new(size_t n)
+#endif
+{
+#ifdef __GNUC__
+  if (count_new_calls)
+    __sync_fetch_and_add(&new_calls, 1);
+#endif
+  void *p = malloc(n ? n : 1);
+  if (!p)
+    throw std::bad_alloc();
+  return p;
+}
+
+#if __cplusplus < 201103L
+void operator delete(void *p) throw()
+#else
+void operator delete(void *p) noexcept
+#endif
+{
+  free(p);
+}
+
+/** Time spent in the phases of a run and some counters, see --stats
+ *
+ * The phases don't overlap: entering a phase pauses the enclosing one,
+ * e.g. validating a referenced file counts as validation, not as
+ * parse_refs. Phases are only entered on the main thread, the CPU time
+ * includes the time of the worker threads, though. Counters may be
+ * incremented from any thread.
+ *
+ * The pipeline (-j N with several inputs) adds the wall and CPU time of
+ * each task to its phase instead, see Task_Timer, thus there the phases
+ * add up to more than the run when the tasks overlap.
+ *
+ * Qt containers allocate with malloc(), thus operator_new_calls only
+ * counts our own objects and the Qt objects that go through operator
+ * new. The heap growth is taken from malloc's statistics instead, thus
+ * it includes all allocations that are still alive at the end, but it
+ * is 0 without glibc 2.33.
+ */
+class Stats {
+  public:
+    enum Phase { PARSE, VALIDATE, PARSE_REFS, SORT, PRINT_MAN, PHASE_COUNT };
+    enum Counter { XML_BYTES, PAGES_WRITTEN, PAGES_UNCHANGED, BYTES_WRITTEN,
+      HEADERS, FUNCTIONS, STRUCTS, REFS, COUNTER_COUNT };
+  private:
+    qint64 wall_ns[PHASE_COUNT];
+    qint64 cpu_us[PHASE_COUNT];
+    qint64 counters[COUNTER_COUNT];
+    QVector<Phase> stack;
+    QElapsedTimer clock;
+    qint64 mark_wall_ns;
+    qint64 mark_cpu_us;
+    qint64 heap_start;
+    QMutex mutex;
+
+    static qint64 cpu_time_us()
+    {
+#ifdef Q_OS_UNIX
+      struct rusage u;
+      getrusage(RUSAGE_SELF, &u);
+      return (qint64(u.ru_utime.tv_sec) + u.ru_stime.tv_sec) * 1000000
+        + u.ru_utime.tv_usec + u.ru_stime.tv_usec;
+#else
+      return 0;
+#endif
+    }
+    static qint64 peak_rss_kb()
+    {
+#ifdef Q_OS_UNIX
+      struct rusage u;
+      getrusage(RUSAGE_SELF, &u);
+      return u.ru_maxrss; // KiB on Linux
+#else
+      return 0;
+#endif
+    }
+    /** Bytes currently allocated with malloc(), or 0 if unknown */
+    static qint64 heap_bytes()
+    {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+      struct mallinfo2 m = mallinfo2();
+      return m.uordblks + m.hblkhd;
+#else
+      return 0;
+#endif
+    }
+    /** Charges the time since the last mark to the current phase */
+    void charge()
+    {
+      qint64 wall = clock.nsecsElapsed();
+      qint64 cpu = cpu_time_us();
+      if (!stack.isEmpty()) {
+        wall_ns[stack.last()] += wall - mark_wall_ns;
+        cpu_us[stack.last()] += cpu - mark_cpu_us;
+      }
+      mark_wall_ns = wall;
+      mark_cpu_us = cpu;
+    }
+  public:
+    Stats()
+      : mark_wall_ns(0), mark_cpu_us(cpu_time_us()), heap_start(heap_bytes())
+    {
+      std::fill(wall_ns, wall_ns + PHASE_COUNT, 0);
+      std::fill(cpu_us, cpu_us + PHASE_COUNT, 0);
+      std::fill(counters, counters + COUNTER_COUNT, 0);
+      clock.start();
+    }
+    void enter(Phase p)
+    {
+      charge();
+      stack.push_back(p);
+    }
+    void leave()
+    {
+      charge();
+      stack.pop_back();
+    }
+    /** Adds the time of a task to p, from any thread */
+    void add_time(Phase p, qint64 wall, qint64 cpu)
+    {
+      QMutexLocker locker(&mutex);
+      wall_ns[p] += wall;
+      cpu_us[p] += cpu;
+    }
+    static qint64 thread_cpu_time_us()
+    {
+#ifdef Q_OS_UNIX
+      struct timespec t;
+      if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t))
+        return 0;
+      return qint64(t.tv_sec) * 1000000 + t.tv_nsec / 1000;
+#else
+      return 0;
+#endif
+    }
+    void add(Counter c, qint64 n = 1)
+    {
+      QMutexLocker locker(&mutex);
+      counters[c] += n;
+    }
+    void print(ostream &o)
+    {
+      static const char *const phase_names[PHASE_COUNT] = {
+        "parse", "validate", "parse_refs", "sort", "print_man" };
+      static const char *const counter_names[COUNTER_COUNT] = {
+        "xml_bytes_read", "pages_written", "pages_unchanged", "bytes_written",
+        "headers", "functions", "structs", "refs" };
+      o << "{\n  \"wall_ms\": " << clock.nsecsElapsed() / 1000000
+        << ",\n  \"cpu_ms\": " << cpu_time_us() / 1000
+        << ",\n  \"phases\": {\n";
+      for (int i = 0; i < PHASE_COUNT; ++i)
+        o << "    \"" << phase_names[i] << "\": { \"wall_ms\": "
+          << wall_ns[i] / 1000000 << ", \"cpu_ms\": " << cpu_us[i] / 1000
+          << " }" << (i + 1 < PHASE_COUNT ? ",\n" : "\n");
+      o << "  },\n";
+      QMutexLocker locker(&mutex);
+      for (int i = 0; i < COUNTER_COUNT; ++i)
+        o << "  \"" << counter_names[i] << "\": " << counters[i] << ",\n";
+      o << "  \"operator_new_calls\": " << new_calls << ",\n"
+        << "  \"heap_growth_bytes\": " << heap_bytes() - heap_start << ",\n"
+        << "  \"peak_rss_kb\": " << peak_rss_kb() << "\n}\n";
+    }
+};
+
+Stats stats;
+
+/** Attributes the lifetime of the object to a phase */
+class Phase_Timer {
+  private:
+    Phase_Timer(const Phase_Timer &);
+    Phase_Timer &operator=(const Phase_Timer &);
+  public:
+    Phase_Timer(Stats::Phase p)
+    {
+      stats.enter(p);
+    }
+    ~Phase_Timer()
+    {
+      stats.leave();
+    }
+};
+
+/** Attributes the lifetime of the object to a phase, on any thread,
+ *  i.e. for the tasks of the pipeline */
+class Task_Timer {
+  private:
+    Stats::Phase phase;
+    QElapsedTimer clock;
+    qint64 cpu_us;
+
+    Task_Timer(const Task_Timer &);
+    Task_Timer &operator=(const Task_Timer &);
+  public:
+    Task_Timer(Stats::Phase p)
+      : phase(p), cpu_us(Stats::thread_cpu_time_us())
+    {
+      clock.start();
+    }
+    ~Task_Timer()
+    {
+      stats.add_time(phase, clock.nsecsElapsed(),
+          Stats::thread_cpu_time_us() - cpu_us);
+    }
+};
+
 enum Direction { DIR_NONE, DIR_IN, DIR_OUT };
 
 /** Temp structure
@@ -64,7 +441,7 @@ struct Parameter_Item {
 };
 
 struct Parameter {
-  QString type;
+  Atom type;
   QString name;
   QString compound_ref;
   QString brief_desc;
@@ -82,11 +459,21 @@ struct Parameter {
     desc = p.desc;
     return *this;
   }
+  void swap(Parameter &o)
+  {
+    std::swap(type, o.type);
+    name.swap(o.name);
+    compound_ref.swap(o.compound_ref);
+    brief_desc.swap(o.brief_desc);
+    desc.swap(o.desc);
+    std::swap(dir, o.dir);
+  }
 };
+Q_DECLARE_TYPEINFO(Parameter, Q_MOVABLE_TYPE);
 
 struct See_Also {
   QString ref_id;
-  QString name;
+  Atom name;
 
   See_Also() {}
 
@@ -96,21 +483,22 @@ struct See_Also {
   }
   void set_name(const QString &s)
   {
-    name = s.trimmed();
+    name = atoms.intern(s.trimmed());
   }
   void set_name_last(const QString &s)
   {
     int i = s.lastIndexOf(' ');
     if (i < 0)
       return;
-    name = s.mid(i+1);
+    name = atoms.intern(s.mid(i+1));
   }
 };
+Q_DECLARE_TYPEINFO(See_Also, Q_MOVABLE_TYPE);
 
 struct Function {
   QString name;
   QVector<Parameter> parameters;
-  QString type;
+  Atom type;
   QVector<QString> authors;
   QVector<Parameter> ret_values;
   QString brief_desc;
@@ -122,17 +510,6 @@ struct Function {
 
   QVector<See_Also> see_also;
 
-  int index_of_parameter(const QString &name)
-  {
-    int i = 0;
-    QVectorIterator<Parameter> itr(parameters);
-    while (itr.hasNext()) {
-      if (itr.next().name == name)
-        return i;
-      ++i;
-    }
-    return -1;
-  }
   bool has_detailed_param_desc() const
   {
     foreach (const Parameter &p, parameters) {
@@ -145,15 +522,43 @@ struct Function {
   {
     return name < other.name;
   }
+  /** Cheap alternative to copying, e.g. when the parser hands over
+   *  a finished function */
+  void swap(Function &o)
+  {
+    name.swap(o.name);
+    parameters.swap(o.parameters);
+    std::swap(type, o.type);
+    authors.swap(o.authors);
+    ret_values.swap(o.ret_values);
+    brief_desc.swap(o.brief_desc);
+    desc.swap(o.desc);
+    return_desc.swap(o.return_desc);
+    copyright.swap(o.copyright);
+    ref_ids.swap(o.ref_ids);
+    see_also.swap(o.see_also);
+  }
 };
+// i.e. QVector may relocate them with memmove
+Q_DECLARE_TYPEINFO(Function, Q_MOVABLE_TYPE);
 
 struct Member {
   QString name;
-  QString type;
+  Atom type;
   QString desc;
   QString brief_desc;
   QString arg_string;
+
+  void swap(Member &o)
+  {
+    name.swap(o.name);
+    std::swap(type, o.type);
+    desc.swap(o.desc);
+    brief_desc.swap(o.brief_desc);
+    arg_string.swap(o.arg_string);
+  }
 };
+Q_DECLARE_TYPEINFO(Member, Q_MOVABLE_TYPE);
 
 struct Struct {
   QString id;
@@ -161,8 +566,79 @@ struct Struct {
   QString desc;
   QString brief_desc;
   QVector<Member> members;
+
+  void swap(Struct &o)
+  {
+    id.swap(o.id);
+    name.swap(o.name);
+    desc.swap(o.desc);
+    brief_desc.swap(o.brief_desc);
+    members.swap(o.members);
+  }
+};
+Q_DECLARE_TYPEINFO(Struct, Q_MOVABLE_TYPE);
+
+/** Appends x to v by swapping, i.e. x is empty afterwards
+ */
+template <typename T>
+void append_swap(QVector<T> &v, T &x)
+{
+  v.push_back(T());
+  v.last().swap(x);
+}
+
+/** 64 bit FNV-1a, i.e. the same on every machine and Qt version */
+quint64 fnv1a(const QByteArray &data)
+{
+  quint64 h = Q_UINT64_C(14695981039346656037);
+  for (int i = 0; i < data.size(); ++i) {
+    h ^= uchar(data[i]);
+    h *= Q_UINT64_C(1099511628211);
+  }
+  return h;
+}
+
+struct Options;
+struct Header;
+
+/** Output format of the pages, see --format
+ *
+ * All formats are rendered from the same parsed model. A renderer only
+ * reads it, thus it may be called from several threads.
+ */
+class Renderer {
+  public:
+    virtual ~Renderer() {}
+    /** Name of the format, e.g. for --format */
+    virtual const char *name() const = 0;
+    /** File name of the page about name, e.g. foo.3 */
+    virtual QString page_name(const QString &name,
+        const Options &opts) const = 0;
+    /** Whether each function gets a page, otherwise the summary page
+     *  contains everything */
+    virtual bool function_pages() const
+    {
+      return true;
+    }
+    /** Whether structs get pages of their own */
+    virtual bool struct_pages(const Options &opts) const
+    {
+      return false;
+    }
+    virtual QByteArray summary(const Header &h, const Options &opts) const = 0;
+    virtual QByteArray function(const Function &f, const Header &h,
+        const Options &opts) const
+    {
+      return QByteArray();
+    }
+    virtual QByteArray structure(const Struct &s, const Options &opts) const
+    {
+      return QByteArray();
+    }
 };
 
+const Renderer *find_renderer(const QString &name);
+
 struct Options {
   QString exec_name;
   bool enable_warnings;
@@ -174,16 +650,32 @@ struct Options {
   bool enable_seealso_all;
   bool enable_sort;
   bool enable_structs;
+  bool dry_run;
+  bool list_changes;
+  bool use_sax;
+  bool streaming;
+  bool watch;
+  bool print_stats;
+  bool gzip;
+  bool struct_so;
   QDir output_dir;
   QString output_dir_path;
   QString man_section;
   QString short_pkg;
   QString pkg;
   QString include_prefix;
+  int jobs;
+  int io_threads;
+  int seealso_max; // 0: unlimited
+  int shard_index; // 1 <= shard_index <= shard_count
+  int shard_count;
+  QDate date; // same on all pages, even when generated around midnight
+  QString cache_dir_path;
+  QString depfile_path;
+  QString tar_path; // '-' means stdout
+  QList<const Renderer*> renderers;
 
-  QString filename;
   QStringList filenames;
-  QString base_path;
 
   Options()
     : enable_warnings(true),
@@ -195,18 +687,41 @@ struct Options {
     enable_seealso_all(true),
     enable_sort(true),
     enable_structs(true),
+    dry_run(false),
+    list_changes(false),
+    use_sax(false),
+    streaming(false),
+    watch(false),
+    print_stats(false),
+    gzip(false),
+    struct_so(false),
     output_dir_path("out"),
     man_section("3"),
     short_pkg("XXXpkg"),
-    pkg("The XXX Manual")
+    pkg("The XXX Manual"),
+    jobs(1),
+    io_threads(2),
+    seealso_max(0),
+    shard_index(1),
+    shard_count(1),
+    date(QDate::currentDate())
   {
+    // cf. https://reproducible-builds.org/specs/source-date-epoch/
+    QByteArray epoch(qgetenv("SOURCE_DATE_EPOCH"));
+    if (!epoch.isEmpty()) {
+      bool ok = false;
+      uint t = epoch.toUInt(&ok);
+      if (!ok)
+        throw runtime_error("Invalid SOURCE_DATE_EPOCH");
+      date = QDateTime::fromTime_t(t).toUTC().date();
+    }
   }
 
   void help()
   {
     cout << "Generates man pages from doxygen XML output\n";
     cout << "\n";
-    cout << "call: " << exec_name << " OPTIONS DOXYGEN_XML_HEADER_FILE\n\n"
+    cout << "call: " << exec_name << " OPTIONS DOXYGEN_XML_FILE...\n\n"
       << "where\n\n"
       << "-h,     --help           this screen\n"
       "        --nowarn         suppress warnings\n"
@@ -215,36 +730,68 @@ struct Options {
       "        --nofollow       don't parse referenced xml files\n"
       "        --novalidate     don't validate xml files against compound.xsd\n"
       "        --noseealsoall   don't add all functions under see also\n"
+      "        --seealso-max N  add at most N related functions under see also,\n"
+      "                         e.g. the ones with the same name prefix\n"
       "        --nosort         don't sort functions under see also\n"
       "        --nostructs      don't print structs in function man pages\n"
+      "        --struct-so      write each struct once (e.g. struct_foo.3) and\n"
+      "                         include it with .so man3/struct_foo.3 (with\n"
+      "                         --gzip: struct_foo.3.gz, thus man-db only)\n"
+      "        --format LIST    comma separated output formats, i.e. man,\n"
+      "                         markdown, html and json (default: man)\n"
       "-d,     --dump           just dump some input\n"
       "-o DIR, --out DIR        output directory\n"
       "-s STR, --section STR    man page section\n"
       "        --short-pkg STR  short man page header/footer string, e.g. 'Linux'\n"
       "        --pkg STR        man page header/footer string, e.g. 'Linux Programmer's Manual'\n"
       "-i STR, --include STR    include path prefix\n"
+      "-j N,   --jobs N         use N threads for parsing referenced files\n"
+      "                         and writing function pages (0: #cores), with\n"
+      "                         several inputs they are pipelined, largest first\n"
+      "        --io-threads N   write the pages in N background threads\n"
+      "                         (default: 2, 0: while rendering)\n"
+      "        --cache-dir DIR  remember validated inputs and parsed models\n"
+      "                         between runs\n"
+      "        --date DATE      date (YYYY-MM-DD) printed on the pages\n"
+      "                         (default: SOURCE_DATE_EPOCH or today)\n"
+      "        --dry-run        just list added/changed/removed pages\n"
+      "        --changes        list added/changed/removed pages\n"
+      "        --depfile PATH   write Makefile dependencies of the pages\n"
+      "        --sax            parse with QXmlSimpleReader (deprecated)\n"
+      "        --stream         write each function page as soon as it is\n"
+      "                         parsed, to bound memory usage on huge headers\n"
+      "        --watch          keep running and regenerate the pages that\n"
+      "                         depend on changed XML files (Linux only)\n"
+      "        --stats          print timings and counters as JSON to stderr,\n"
+      "                         e.g. operator new calls and heap growth (0\n"
+      "                         without glibc 2.33)\n"
+      "        --gzip           write gzip compressed pages (e.g. foo.3.gz)\n"
+      "        --tar FILE       write all pages into a tar file instead of\n"
+      "                         the output directory ('-': stdout)\n"
+      "        --shard I/N      only write the pages of shard I of N, i.e.\n"
+      "                         the N runs together write all pages\n"
+      "\n"
+      "A DOXYGEN_XML_FILE is either a file compound (e.g. foo_8h.xml) or\n"
+      "an index.xml - in which case all file compounds it lists are processed.\n"
       "\n"
          "Version: " << doxy2man::name << " " << doxy2man::ver << "\n"
       << "Author : " << doxy2man::author << " <" << doxy2man::mail << ">, (" << doxy2man::date << ")\n"
       << "\n";
   }
-  void check_input_filename()
+  void check_input_filenames()
   {
     if (filenames.isEmpty()) {
       throw runtime_error( "No XML input file specified");
     }
-    if (filenames.size() > 1)
-      throw runtime_error("More than one input file specified");
-    filename = filenames.front();
-    QFile file(filename);
-    if (!file.exists()) {
-      QString msg("Input file ");
-      msg += filename;
-      msg += " does not exist";
-      throw runtime_error(msg.toUtf8().data());
+    foreach (const QString &filename, filenames) {
+      QFile file(filename);
+      if (!file.exists()) {
+        QString msg("Input file ");
+        msg += filename;
+        msg += " does not exist";
+        throw runtime_error(msg.toUtf8().data());
+      }
     }
-    QFileInfo info(filename);
-    base_path = info.path();
   }
   void parse(const QStringList &list)
   {
@@ -253,6 +800,15 @@ struct Options {
     bool read_include_prefix = false;
     bool read_short_pkg = false;
     bool read_pkg = false;
+    bool read_jobs = false;
+    bool read_io_threads = false;
+    bool read_seealso_max = false;
+    bool read_cache_dir = false;
+    bool read_date = false;
+    bool read_depfile = false;
+    bool read_tar = false;
+    bool read_format = false;
+    bool read_shard = false;
     bool only_filenames = false;
     QStringListIterator i(list);
     if (i.hasNext()) {
@@ -283,6 +839,86 @@ struct Options {
         include_prefix = q;
         read_include_prefix = false;
       }
+      else if (read_cache_dir) {
+        cache_dir_path = q;
+        read_cache_dir = false;
+      }
+      else if (read_depfile) {
+        depfile_path = q;
+        read_depfile = false;
+      }
+      else if (read_tar) {
+        tar_path = q;
+        read_tar = false;
+      }
+      else if (read_shard) {
+        QStringList l(q.split('/'));
+        bool ok = l.size() == 2;
+        if (ok)
+          shard_index = l[0].toInt(&ok);
+        if (ok)
+          shard_count = l[1].toInt(&ok);
+        if (!ok || shard_index < 1 || shard_index > shard_count) {
+          QString s("Invalid shard: ");
+          s += q;
+          throw runtime_error(s.toUtf8().data());
+        }
+        read_shard = false;
+      }
+      else if (read_format) {
+        foreach (const QString &name, q.split(',', QString::SkipEmptyParts)) {
+          const Renderer *r = find_renderer(name);
+          if (!r) {
+            QString s("Unknown format: ");
+            s += name;
+            throw runtime_error(s.toUtf8().data());
+          }
+          if (!renderers.contains(r))
+            renderers << r;
+        }
+        read_format = false;
+      }
+      else if (read_date) {
+        date = QDate::fromString(q, "yyyy-MM-dd");
+        if (!date.isValid()) {
+          QString s("Invalid date: ");
+          s += q;
+          throw runtime_error(s.toUtf8().data());
+        }
+        read_date = false;
+      }
+      else if (read_jobs) {
+        bool ok = false;
+        jobs = q.toInt(&ok);
+        if (!ok || jobs < 0) {
+          QString s("Invalid number of jobs: ");
+          s += q;
+          throw runtime_error(s.toUtf8().data());
+        }
+        if (!jobs)
+          jobs = QThread::idealThreadCount();
+        read_jobs = false;
+      }
+      else if (read_seealso_max) {
+        bool ok = false;
+        seealso_max = q.toInt(&ok);
+        if (!ok || seealso_max < 0) {
+          QString s("Invalid see also limit: ");
+          s += q;
+          throw runtime_error(s.toUtf8().data());
+        }
+        read_seealso_max = false;
+      }
+      else if (read_io_threads) {
+        bool ok = false;
+        io_threads = q.toInt(&ok);
+        if (!ok || io_threads < 0) {
+          QString s("Invalid number of I/O threads: ");
+          s += q;
+          throw runtime_error(s.toUtf8().data());
+        }
+        read_io_threads = false;
+      }
       else if (q == "--nowarn")
         enable_warnings = false;
       else if (q == "--nosummary")
@@ -295,10 +931,16 @@ struct Options {
         enable_validate = false;
       else if (q == "--noseealsoall")
         enable_seealso_all = false;
+      else if (q == "--seealso-max")
+        read_seealso_max = true;
       else if (q == "--nosort")
         enable_sort = false;
       else if (q == "--nostructs")
         enable_structs = false;
+      else if (q == "--struct-so")
+        struct_so = true;
+      else if (q == "--format")
+        read_format = true;
       else if (q == "-d" || q == "--dump")
         just_dump = true;
       else if (q == "-o" || q == "--out")
@@ -311,6 +953,36 @@ struct Options {
         read_pkg = true;
       else if (q == "-i" || q == "--include-prefix")
         read_include_prefix = true;
+      else if (q == "-j" || q == "--jobs")
+        read_jobs = true;
+      else if (q == "--io-threads")
+        read_io_threads = true;
+      else if (q == "--cache-dir")
+        read_cache_dir = true;
+      else if (q == "--date")
+        read_date = true;
+      else if (q == "--depfile")
+        read_depfile = true;
+      else if (q == "--dry-run")
+        dry_run = true;
+      else if (q == "--changes")
+        list_changes = true;
+      else if (q == "--sax")
+        use_sax = true;
+      else if (q == "--stream")
+        streaming = true;
+      else if (q == "--watch")
+        watch = true;
+      else if (q == "--stats") {
+        print_stats = true;
+        count_new_calls = true;
+      }
+      else if (q == "--gzip")
+        gzip = true;
+      else if (q == "--tar")
+        read_tar = true;
+      else if (q == "--shard")
+        read_shard = true;
       else if (q == "--")
         only_filenames = true;
       else if (q == "-h" || q == "--help") {
@@ -325,11 +997,41 @@ struct Options {
         filenames << q;
       }
     }
-    check_input_filename();
+    check_input_filenames();
+    if (renderers.isEmpty())
+      renderers << find_renderer("man");
+    if (streaming) {
+      foreach (const Renderer *r, renderers) {
+        if (!r->function_pages()) {
+          QString s("--stream can't be combined with --format ");
+          s += r->name();
+          throw runtime_error(s.toUtf8().data());
+        }
+      }
+    }
+    if (watch && (just_dump || streaming || !tar_path.isEmpty()))
+      throw runtime_error(
+          "--watch can't be combined with --dump, --stream or --tar");
+  }
+
+  /** Whether the pages about name (e.g. a function) belong to this
+   *  shard
+   *
+   * Depends only on the name, thus the shards don't need to agree on
+   * anything but N.
+   */
+  bool in_shard(const QString &name) const
+  {
+    return shard_count == 1
+      || fnv1a(name.toUtf8()) % shard_count == quint64(shard_index - 1);
   }
 
   void check_create_output_dir()
   {
+    if (dry_run) {
+      output_dir.setPath(output_dir_path);
+      return;
+    }
     if (!output_dir.mkpath(output_dir_path)) {
       QString m("Could not create output dir: ");
       m += output_dir_path;
@@ -339,7 +1041,64 @@ struct Options {
   }
 };
 
+/** Structs of all referenced compounds parsed in this run
+ *
+ * Keyed by the refid of the compound, thus each referenced XML file is
+ * parsed at most once, even if many headers refer to it. Only one
+ * thread adds to it, while the page writing threads may look up structs,
+ * see Pipeline. The structs don't move once added, the headers point to
+ * them.
+ */
+class Compound_Index {
+  private:
+    QMap<QString, QVector<const Struct*> > files; // compound id -> structs
+    QMap<QString, Struct> structs; // struct id -> struct
+    mutable QReadWriteLock lock; // for find() in other threads
+  public:
+    bool contains(const QString &ref_id) const
+    {
+      return files.contains(ref_id);
+    }
+    /** Adds or replaces the structs of a compound
+     *
+     * A struct that is replaced keeps its address.
+     */
+    void add(const QString &ref_id, QVector<Struct> &v)
+    {
+      QWriteLocker locker(&lock);
+      QVector<const Struct*> &ptrs = files[ref_id];
+      ptrs.clear();
+      for (int i = 0; i < v.size(); ++i) {
+        Struct &st = structs[v[i].id];
+        st.swap(v[i]);
+        ptrs.push_back(&st);
+      }
+    }
+    const QVector<const Struct*> &file(const QString &ref_id) const
+    {
+      QMap<QString, QVector<const Struct*> >::const_iterator i =
+        files.constFind(ref_id);
+      if (i == files.constEnd())
+        throw range_error(("unknown compound: " + ref_id).toUtf8().data());
+      return i.value();
+    }
+    const Struct *find(const QString &id) const
+    {
+      QReadLocker locker(&lock);
+      QMap<QString, Struct>::const_iterator i = structs.constFind(id);
+      return i == structs.constEnd() ? 0 : &i.value();
+    }
+    void clear()
+    {
+      QWriteLocker locker(&lock);
+      files.clear();
+      structs.clear();
+    }
+};
+
 struct Header {
+  QString filename; // XML input
+  QString base_path; // directory of the XML input
   QString name;
   QString module_name; // e.g. without extension
   QString brief_desc;
@@ -347,29 +1106,106 @@ struct Header {
   QString copyright;
 
   QVector<Function> functions;
-  QVector<Function> functions_sorted;
-  QVector<Struct> structs;
+  QVector<int> sorted_index; // permutation of functions, see sort()
+  QVector<int> by_name; // like sorted_index, but even with --nosort
+  QVector<Struct> structs; // defined in the XML input itself
+  QVector<const Struct*> ref_structs; // referenced ones, see parse_refs()
 
   QSet<QString> ref_ids;
   QMap<QString, size_t> ref_id_struct_map;
+  const Compound_Index *compounds;
+
+  Header()
+    : compounds(0)
+  {
+  }
 
   const Struct &struct_by_id(const QString &id) const
   {
-    if (!ref_id_struct_map.contains(id)) {
-      QString msg("unknown reference: ");
-      msg += id;
-      throw range_error(msg.toUtf8().data());
+    if (ref_id_struct_map.contains(id))
+      return structs[ref_id_struct_map[id]];
+    if (compounds) {
+      const Struct *st = compounds->find(id);
+      if (st)
+        return *st;
     }
-    size_t i = ref_id_struct_map[id];
-    return structs[i];
+    QString msg("unknown reference: ");
+    msg += id;
+    throw range_error(msg.toUtf8().data());
   }
 
+  struct Name_Less {
+    const QVector<Function> &functions;
+    Name_Less(const QVector<Function> &functions)
+      : functions(functions)
+    {
+    }
+    bool operator()(int a, int b) const
+    {
+      return functions[a] < functions[b];
+    }
+  };
   void sort(const Options &o)
   {
-    functions_sorted = functions;
-    if (o.enable_sort) {
-      qSort(functions_sorted.begin(), functions_sorted.end());
+    sorted_index.resize(functions.size());
+    for (int i = 0; i < functions.size(); ++i)
+      sorted_index[i] = i;
+    by_name = sorted_index;
+    qSort(by_name.begin(), by_name.end(), Name_Less(functions));
+    if (o.enable_sort)
+      sorted_index = by_name;
+  }
+  /** Position in by_name of the first function not less than name */
+  int lower_bound(const QString &name) const
+  {
+    int a = 0, b = by_name.size();
+    while (a < b) {
+      int m = a + (b - a) / 2;
+      if (functions[by_name[m]].name < name)
+        a = m + 1;
+      else
+        b = m;
+    }
+    return a;
+  }
+  /** Appends the indices of at most max functions related to f
+   *
+   * That is the largest group of functions that share an underscore
+   * delimited name prefix with f (e.g. omg_conn_) and still fits, or
+   * else (also when that group is just f) the neighbours of f in name
+   * order. Thus, the see also sections
+   * of all function pages grow linearly with the number of functions.
+   */
+  void related(const Function &f, int max, QVector<int> &r) const
+  {
+    for (int i = f.name.indexOf('_'); i > 0; i = f.name.indexOf('_', i + 1)) {
+      QString prefix(f.name.left(i + 1));
+      QString next(f.name.left(i));
+      next += QChar('_' + 1);
+      int a = lower_bound(prefix);
+      int b = lower_bound(next);
+      if (b - a - 1 > max)
+        continue;
+      // longer prefixes only match fewer functions
+      if (b - a - 1 < 1)
+        break;
+      for (int k = a; k < b; ++k)
+        if (functions[by_name[k]].name != f.name)
+          r.push_back(by_name[k]);
+      return;
     }
+    int pos = lower_bound(f.name);
+    int a = qMax(0, pos - max / 2);
+    int b = qMin(by_name.size(), a + max + 1);
+    a = qMax(0, b - max - 1);
+    for (int k = a; k < b; ++k)
+      if (k != pos)
+        r.push_back(by_name[k]);
+  }
+  /** i-th function in sort order */
+  const Function &sorted(int i) const
+  {
+    return functions[sorted_index[i]];
   }
   void check(ostream &o)
   {
@@ -388,11 +1224,11 @@ struct Header {
 };
 
 
-QString ref2file(const QString &ref_id, const Options &o)
+QString ref2file(const QString &ref_id, const QString &base_path)
 {
   QString name(ref_id);
   name += ".xml";
-  QString filename(o.base_path);
+  QString filename(base_path);
   filename += QDir::separator();
   filename += name;
   QFile file(filename);
@@ -421,23 +1257,20 @@ void print_dump(ostream &o, const Header &h)
   foreach (const Function &f, h.functions) {
     o << f.type << ' ' << f.name << "\n"
       << "    (\n";
-    QVectorIterator<Parameter> i(f.parameters);
-
-    Parameter a;
-    if (i.hasNext()) {
-      a = i.next();
-      o << "        " << a.type << ' ' << a.name;
-    }
-    if (!i.hasNext()) {
-      if (!a.brief_desc.isEmpty())
-        o << " // " << a.brief_desc;
-    } else while (i.hasNext()) {
-      o << ",";
-      if (!a.brief_desc.isEmpty())
-        o << " // " << a.brief_desc;
-      o << '\n';
-      a = i.next();
+    int n = f.parameters.size();
+    for (int i = 0; i < n; ++i) {
+      const Parameter &a = f.parameters[i];
       o << "        " << a.type << ' ' << a.name;
+      // the brief description of the last one is only printed
+      // if it is the only one
+      if (n == 1 || i+1 < n) {
+        if (i+1 < n)
+          o << ",";
+        if (!a.brief_desc.isEmpty())
+          o << " // " << a.brief_desc;
+        if (i+1 < n)
+          o << '\n';
+      }
     }
 
     o << "\n    )\n"
@@ -459,14 +1292,17 @@ void print_dump(ostream &o, const Header &h)
   foreach (const Struct &st, h.structs) {
     o << "struct " << st.name << '\n';
   }
+  foreach (const Struct *st, h.ref_structs) {
+    o << "struct " << st->name << '\n';
+  }
 }
 
-size_t get_type_width(const QVector<Function> &list)
+size_t get_type_width(const QVector<Function> &list) // order doesn't matter
 {
   size_t w = 5;
   foreach (const Function &f, list) {
-    if (f.type.size() > w)
-      w = f.type.size();
+    if (atoms.size(f.type) > w)
+      w = atoms.size(f.type);
   }
   return w+1;
 }
@@ -475,8 +1311,8 @@ size_t get_type_width(const QVector<Member> &list)
 {
   size_t w = 8;
   foreach (const Member &f, list) {
-    if (f.type.size() > w)
-      w = f.type.size();
+    if (atoms.size(f.type) > w)
+      w = atoms.size(f.type);
   }
   return w+1;
 }
@@ -485,96 +1321,387 @@ size_t get_type_width(const QVector<Parameter> &list)
 {
   size_t w = 8;
   foreach (const Parameter &f, list) {
-    QString a(f.type.trimmed());
-    if (a.size() > w)
-      w = a.size();
+    if (atoms.trimmed_size(f.type) > w)
+      w = atoms.trimmed_size(f.type);
   }
   return w+1;
 }
 
-QString fill_right(const QString &s, size_t w)
-{
-  QString a = s.trimmed();
-  if (a.size() >=  w)
-    return a;
-  QString wstr(w-a.size(), ' ');
-  if (!a.isEmpty() && a[a.size()-1] == '*') {
-    int i = a.size()-2;
-    for (; i>0; --i)
-      if (a[i] != '*')
-        break;
-    ++i;
-    a.insert(i, wstr);
-  } else
-    a.append(wstr);
-  return a;
-}
-
-QString first_line(const QString &s)
-{
-  QString a = s.trimmed();
-  int i = a.indexOf('\n');
-  if (i == -1)
-    return a;
-  return a.left(i);
-}
+/** Append-only UTF-8 buffer a page is rendered into
+ *
+ * Strings are encoded while they are appended, atoms are copied from
+ * their cached UTF-8 bytes, and the helpers trim, pad and split in
+ * place, i.e. without temporary QStrings. The buffer is reserved up
+ * front, thus a typical page is rendered without any reallocation.
+ *
+ * Strings and atoms are text and thus escaped for the output format,
+ * C strings and chars are markup and appended as is.
+ */
+class Page_Buffer {
+  public:
+    enum Escaping { RAW, ROFF, MARKDOWN, HTML, JSON };
+  private:
+    QByteArray buf;
+    Escaping escaping;
 
-QStringList extract_authors(const QVector<Function> &functions)
-{
-  QStringList list;
-  foreach (const Function &f, functions) {
-    foreach (const QString &a, f.authors) {
-      list << a;
+    static bool is_space(ushort c)
+    {
+      return QChar(c).isSpace();
     }
-  }
-  // list.sort();
-  // QStringList::iterator end = unique(list.begin(), list.end());
-  list.removeDuplicates();
-  list.sort();
-  return list;
-}
-
-size_t max_member_size(const QVector<Member> &parameters)
-{
-  size_t r = 0;
-  foreach (const Member &p, parameters) {
-    size_t x = p.name.size();
-    if (x > r)
-      r = x;
-  }
-  return r;
-}
-
-void print_brief(QTextStream &o, size_t w, const Member &p)
+    /** Bounds of s without leading and trailing white space */
+    static void trim(const QString &s, int &b, int &e)
+    {
+      b = 0;
+      e = s.size();
+      while (b < e && is_space(s[b].unicode()))
+        ++b;
+      while (e > b && is_space(s[e - 1].unicode()))
+        --e;
+    }
+    static bool is_control(QChar c)
+    {
+      return c.unicode() < 0x80 && roff_is_control(c.unicode());
+    }
+    bool special(uchar c) const
+    {
+      switch (escaping) {
+        case MARKDOWN:
+          return c && strchr("\\`*_[]<>#|", c);
+        case HTML:
+          return c == '&' || c == '<' || c == '>' || c == '"';
+        case JSON:
+          return c == '"' || c == '\\' || c < 0x20;
+        default:
+          return false;
+      }
+    }
+    enum { MAX_ESCAPE = 6 }; // e.g. &quot; or \u001f
+    /** Writes the escape sequence of the special character c to d,
+     *  returns its end */
+    char *put_special(char *d, uchar c) const
+    {
+      static const char hex[] = "0123456789abcdef";
+      const char *s = 0;
+      switch (escaping) {
+        case MARKDOWN:
+          *d++ = '\\';
+          *d++ = c;
+          break;
+        case HTML:
+          s = c == '&' ? "&amp;" : c == '<' ? "&lt;"
+            : c == '>' ? "&gt;" : "&quot;";
+          while (*s)
+            *d++ = *s++;
+          break;
+        case JSON:
+          *d++ = '\\';
+          if (c == '\n') {
+            *d++ = 'n';
+          } else if (c < 0x20) {
+            *d++ = 'u';
+            *d++ = '0';
+            *d++ = '0';
+            *d++ = hex[c >> 4];
+            *d++ = hex[c & 0xf];
+          } else {
+            *d++ = c;
+          }
+          break;
+        default:
+          *d++ = c;
+      }
+      return d;
+    }
+    /** Bytes a QChar may become, i.e. 3 unless an escape sequence is
+     *  longer */
+    int max_bytes() const
+    {
+      return escaping == HTML || escaping == JSON ? MAX_ESCAPE : 3;
+    }
+  public:
+    Page_Buffer(Escaping escaping)
+      : escaping(escaping)
+    {
+      buf.reserve(16 * 1024);
+    }
+    /** Escaping of the following strings and atoms, e.g. RAW in code
+     *  blocks */
+    void set_escaping(Escaping e)
+    {
+      escaping = e;
+    }
+    const QByteArray &data() const
+    {
+      return buf;
+    }
+
+    /** Encodes UTF-16 to UTF-8 and escapes in the same pass
+     *
+     * All special characters are ASCII, thus only that branch checks
+     * for them.
+     */
+    void append(const QChar *p, int n)
+    {
+      int old = buf.size();
+      bool bol = !old || buf[old - 1] == '\n';
+      // a surrogate pair needs 4 bytes, i.e. 2 per QChar
+      buf.resize(old + max_bytes() * n);
+      char *d = buf.data() + old;
+      if (escaping == ROFF && bol && n && is_control(p[0])) {
+        *d++ = '\\';
+        *d++ = '&';
+      }
+      for (int i = 0; i < n; ++i) {
+        uint c = p[i].unicode();
+        if (c < 0x80) {
+          if (escaping == ROFF) {
+            if (c == '\\') {
+              *d++ = '\\';
+              *d++ = 'e';
+              continue;
+            }
+            *d++ = c;
+            // i.e. only the line starts are checked for . and '
+            if (c == '\n' && i + 1 < n && is_control(p[i + 1])) {
+              *d++ = '\\';
+              *d++ = '&';
+            }
+          } else if (special(c)) {
+            d = put_special(d, c);
+          } else {
+            *d++ = c;
+          }
+          continue;
+        }
+        if (c < 0x800) {
+          *d++ = 0xc0 | c >> 6;
+        } else if ((c & 0xfc00) == 0xd800 && i + 1 < n
+            && (p[i + 1].unicode() & 0xfc00) == 0xdc00) {
+          c = 0x10000 + ((c - 0xd800) << 10) + (p[++i].unicode() - 0xdc00);
+          *d++ = 0xf0 | c >> 18;
+          *d++ = 0x80 | (c >> 12 & 0x3f);
+          *d++ = 0x80 | (c >> 6 & 0x3f);
+        } else {
+          *d++ = 0xe0 | c >> 12;
+          *d++ = 0x80 | (c >> 6 & 0x3f);
+        }
+        *d++ = 0x80 | (c & 0x3f);
+      }
+      buf.resize(d - buf.data());
+    }
+    /** Appends UTF-8 escaped, straight from s
+     *
+     * Usually there is nothing to escape, then the bytes are only
+     * scanned and copied.
+     */
+    void append(const QByteArray &s)
+    {
+      int n = s.size();
+      int k = 0;
+      bool bol = buf.isEmpty() || buf[buf.size() - 1] == '\n';
+      if (escaping == RAW)
+        k = n;
+      else if (escaping == ROFF)
+        k = roff_find_escape(s.constData(), n, bol);
+      else
+        while (k < n && !special(s[k]))
+          ++k;
+      buf.append(s.constData(), k);
+      if (k == n)
+        return;
+      int old = buf.size();
+      buf.resize(old + max_bytes() * (n - k));
+      char *d = buf.data() + old;
+      if (escaping == ROFF) {
+        bol = !old || buf[old - 1] == '\n';
+        d = roff_escape(s.constData() + k, n - k, d, bol);
+      } else {
+        for (; k < n; ++k) {
+          if (special(s[k]))
+            d = put_special(d, s[k]);
+          else
+            *d++ = s[k];
+        }
+      }
+      buf.resize(d - buf.data());
+    }
+    Page_Buffer &operator<<(const QString &s)
+    {
+      append(s.constData(), s.size());
+      return *this;
+    }
+    Page_Buffer &operator<<(Atom a)
+    {
+      append(atoms.utf8(a));
+      return *this;
+    }
+    Page_Buffer &operator<<(const char *s)
+    {
+      buf += s;
+      return *this;
+    }
+    Page_Buffer &operator<<(char c)
+    {
+      buf += c;
+      return *this;
+    }
+
+    void pad(int n)
+    {
+      if (n > 0)
+        buf.append(QByteArray(n, ' '));
+    }
+    /** Appends s trimmed and padded to w, a pointer's stars are moved
+     *  to the right, e.g. 'char   **' */
+    void fill_right(const QString &s, size_t w)
+    {
+      int b, e;
+      trim(s, b, e);
+      int n = e - b;
+      if (size_t(n) >= w) {
+        append(s.constData() + b, n);
+        return;
+      }
+      if (n && s[e - 1] == '*') {
+        int i = n - 2;
+        while (i > 0 && s[b + i] == '*')
+          --i;
+        ++i;
+        append(s.constData() + b, i);
+        pad(w - n);
+        append(s.constData() + b + i, n - i);
+      } else {
+        append(s.constData() + b, n);
+        pad(w - n);
+      }
+    }
+    void fill_right(Atom a, size_t w)
+    {
+      fill_right(atoms.str(a), w);
+    }
+    void first_line(const QString &s)
+    {
+      int b, e;
+      trim(s, b, e);
+      int i = s.indexOf('\n', b);
+      append(s.constData() + b, (i == -1 || i > e ? e : i) - b);
+    }
+    void without_fullstop(const QString &s)
+    {
+      int b, e;
+      trim(s, b, e);
+      if (e > b && s[e - 1] == '.')
+        --e;
+      append(s.constData() + b, e - b);
+    }
+    /** Appends each non-empty line of s as a paragraph, i.e. between
+     *  begin and end */
+    void paragraphs(const QString &s, const char *begin, const char *end)
+    {
+      int b = 0;
+      while (b < s.size()) {
+        int e = s.indexOf('\n', b);
+        if (e == -1)
+          e = s.size();
+        if (e > b) {
+          buf += begin;
+          append(s.constData() + b, e - b);
+          buf += end;
+        }
+        b = e + 1;
+      }
+    }
+};
+
+/** Page_Buffer with the roff requests of a man page */
+class Roff : public Page_Buffer {
+  public:
+    Roff()
+      : Page_Buffer(ROFF)
+    {
+    }
+    void paragraphs(const QString &s)
+    {
+      // line break, vert space, restore left margin/indent
+      Page_Buffer::paragraphs(s, ".PP \n", "\n");
+    }
+
+    /** Comment and .TH title line of a page */
+    void title(const QString &name, const Options &opts)
+    {
+      *this << ".\\\" File automatically generated by "
+        << doxy2man::name << doxy2man::ver << '\n';
+      *this << ".\\\" Generation date: " << opts.date.toString() << '\n';
+      th(name, opts);
+    }
+    /** .TH title line, e.g. of a page that others include */
+    void th(const QString &name, const Options &opts)
+    {
+      *this << ".TH " << name << ' ' << opts.man_section << ' '
+        << opts.date.toString("yyyy-MM-dd") << " \""
+        << opts.short_pkg << "\" \"" << opts.pkg << "\"\n";
+    }
+    void section(const char *name)
+    {
+      *this << ".SH " << name << '\n';
+    }
+    /** Indented paragraph labeled with name in bold face */
+    void tagged(const QString &name)
+    {
+      *this << ".TP\n"; // indented labeled paragraph, next line is label
+      *this << ".B "; // bold face
+      *this << name << '\n';
+    }
+    void man_ref(const QString &name, const Options &opts)
+    {
+      *this << "\\fI" << name << "\\fP(" << opts.man_section << ')';
+    }
+};
+
+QStringList extract_authors(const QVector<Function> &functions)
 {
-  if (p.brief_desc.isEmpty())
-    return;
-  size_t used = p.name.size();
-  QString wstr(w > used ? (w-used) : 0, ' ');
-  o << wstr << " // " << p.brief_desc;
+  QStringList list;
+  foreach (const Function &f, functions) {
+    foreach (const QString &a, f.authors) {
+      list << a;
+    }
+  }
+  // list.sort();
+  // QStringList::iterator end = unique(list.begin(), list.end());
+  list.removeDuplicates();
+  list.sort();
+  return list;
+}
 
+size_t max_member_size(const QVector<Member> &parameters)
+{
+  size_t r = 0;
+  foreach (const Member &p, parameters) {
+    size_t x = p.name.size();
+    if (x > r)
+      r = x;
+  }
+  return r;
 }
 
-QString remove_fullstop(const QString &x)
+void print_brief(Roff &o, size_t w, const Member &p)
 {
-  QString s(x.trimmed());
-  if (s.endsWith('.'))
-    return s.left(s.size()-1);
-  return s;
+  if (p.brief_desc.isEmpty())
+    return;
+  size_t used = p.name.size();
+  o.pad(w > used ? (w-used) : 0);
+  o << " // " << p.brief_desc;
+
 }
 
-void print_struct(QTextStream &o, const Struct &s)
+void print_struct(Roff &o, const Struct &s)
 {
     o << ".SS \""; // subsection
-    o << remove_fullstop(s.brief_desc);
+    o.without_fullstop(s.brief_desc);
     o << "\"\n";
     o << ".PP\n"; // vert space, restore indent/margin
     o << ".sp\n"; // space
-    QStringList paras = s.desc.split("\n", QString::SkipEmptyParts);
-    foreach (const QString p, paras) {
-      o << ".PP \n"; // line break, vert space, restore left margin/indent
-      o << p << '\n';
-    }
+    o.paragraphs(s.desc);
     o << ".sp\n";
     o << ".RS\n"; // reset left margin
     o << ".nf\n"; // no filling of output lines
@@ -583,8 +1710,9 @@ void print_struct(QTextStream &o, const Struct &s)
     size_t w = get_type_width(s.members);
     size_t name_size = max_member_size(s.members);
     foreach (const Member &m, s.members) {
-      o << "  " << fill_right(m.type, w)  << "\\fI" << m.name << "\\fP"
-        << m.arg_string << ';';
+      o << "  ";
+      o.fill_right(m.type, w);
+      o << "\\fI" << m.name << "\\fP" << m.arg_string << ';';
       print_brief(o, name_size, m);
       o << "\n";
     }
@@ -594,30 +1722,22 @@ void print_struct(QTextStream &o, const Struct &s)
     o << ".RE\n"; // move left margin back to the left
 }
 
-void print_man_summary(QTextStream &o, const Header &h, const Options &opts)
+void print_man_summary(Roff &o, const Header &h, const Options &opts)
 {
-  o << ".\\\" File automatically generated by " << doxy2man::name << doxy2man::ver << '\n';
-  o << ".\\\" Generation date: " << QDate::currentDate().toString() << '\n';
-
-  o << ".TH " << h.module_name << ' ' << opts.man_section << ' '
-    << QDate::currentDate().toString("yyyy-MM-dd") << " \"" << opts.short_pkg << "\" \""
-    << opts.pkg << "\"\n";
+  o.title(h.module_name, opts);
 
-  o << ".SH \"NAME\"\n"
-    << h.name << " \\- " << first_line(h.brief_desc) << '\n';
+  o.section("\"NAME\"");
+  o << h.name << " \\- ";
+  o.first_line(h.brief_desc);
+  o << '\n';
 
-  o << ".SH SYNOPSIS\n";
+  o.section("SYNOPSIS");
   o << ".nf\n"; // no filling of output lines
   o << ".B #include <" << opts.include_prefix << h.name << ">\n";
   o << ".fi\n"; // fill output lines
 
-  o << ".SH DESCRIPTION\n";
-  
-  QStringList paras = h.desc.split("\n", QString::SkipEmptyParts);
-  foreach (const QString p, paras) {
-    o << ".PP \n"; // line break, vert space, restore left margin/indent
-    o << p << '\n';
-  }
+  o.section("DESCRIPTION");
+  o.paragraphs(h.desc);
 
   o << ".PP\n";
   // o << ".sp\n"; // one blank line
@@ -626,9 +1746,11 @@ void print_man_summary(QTextStream &o, const Header &h, const Options &opts)
   o << ".RS\n"; // move left margin to the right
   o << ".nf\n"; // no filling of output lines
   o << "\\fB\n"; // font to bold face
-  size_t w = get_type_width(h.functions_sorted);
-  foreach (const Function &f, h.functions_sorted) {
-    o << fill_right(f.type, w) << f.name << "(";
+  size_t w = get_type_width(h.functions);
+  for (int k = 0; k < h.functions.size(); ++k) {
+    const Function &f = h.sorted(k);
+    o.fill_right(f.type, w);
+    o << f.name << "(";
     QVectorIterator<Parameter> i(f.parameters);
     if (i.hasNext())
       o << i.next().type;
@@ -645,17 +1767,18 @@ void print_man_summary(QTextStream &o, const Header &h, const Options &opts)
   foreach (const Struct &s, h.structs) {
     print_struct(o, s);
   }
+  foreach (const Struct *s, h.ref_structs) {
+    print_struct(o, *s);
+  }
 
-  o << ".SH SEE ALSO\n";
+  o.section("SEE ALSO");
   o << ".PP\n"; // 'paragraph'
   o << ".nh\n"; // disable hyphenation
   o << ".ad l\n"; // left justified
-  QVectorIterator<Function> i(h.functions_sorted);
-  if (i.hasNext())
-    o << "\\fI" << i.next().name << "\\fP(" << opts.man_section << ")";
-  while (i.hasNext()) {
-    o << ", ";
-    o << "\\fI" << i.next().name << "\\fP(" << opts.man_section << ")";
+  for (int k = 0; k < h.functions.size(); ++k) {
+    if (k)
+      o << ", ";
+    o.man_ref(h.sorted(k).name, opts);
   }
   o << '\n';
   o << ".ad\n"; // justified default (?)
@@ -663,7 +1786,7 @@ void print_man_summary(QTextStream &o, const Header &h, const Options &opts)
 
   QStringList authors = extract_authors(h.functions);
   if (!authors.isEmpty()) {
-    o << ".SH AUTHORS\n";
+    o.section("AUTHORS");
     o << ".nf\n"; // no filling of output lines
     foreach (const QString &author, authors)
       o << author << '\n';
@@ -671,7 +1794,7 @@ void print_man_summary(QTextStream &o, const Header &h, const Options &opts)
   }
 
   if (opts.enable_copyright && !h.copyright.isEmpty()) {
-    o << ".SH COPYRIGHT\n"; // section heading
+    o.section("COPYRIGHT");
     o << ".PP\n"; // paragraph
     o << h.copyright << '\n';
   }
@@ -690,159 +1813,911 @@ void open_for_writing(QFile &file, const QString &full_name)
   }
 }
 
-void flush_stream(QTextStream &o, const QString &full_name)
+QString page_name(const QString &name, const Options &opts)
 {
-  o.flush();
-  if (o.status() != QTextStream::Ok) {
-    QString m("Opening stream for writing failed: ");
-    m += full_name;
-    throw runtime_error(m.toUtf8().data());
-  }
+  QString page_name(name);
+  page_name += '.';
+  page_name += opts.man_section;
+  return page_name;
 }
 
-void print_man_summary_page(const Header &h, const Options &opts)
+QString struct_page_name(const Struct &s, const Options &opts)
 {
-  if (!opts.enable_summary_page)
-    return;
-
-    QString page_name(h.name);
-    page_name += '.';
-    page_name += opts.man_section;
-    QString full_name(opts.output_dir.path() + QDir::separator() + page_name);
-
-    QFile file(full_name);
-    open_for_writing(file, full_name);
-    QTextStream o(&file);
-
-    print_man_summary(o, h, opts);
+  return page_name("struct_" + s.name, opts);
+}
 
-    flush_stream(o, full_name);
-    file.close();
+/** Returns a name next to full_name that no other thread or process
+ *  writes to, e.g. when two inputs generate the same page
+ */
+QString temp_name(const QString &full_name)
+{
+  static QAtomicInt counter;
+  return QString("%1.tmp.%2.%3").arg(full_name)
+    .arg(QCoreApplication::applicationPid())
+    .arg(counter.fetchAndAddRelaxed(1));
 }
 
-size_t max_param_size(const QVector<Parameter> &parameters)
+/** Writes full_name via a temporary file, i.e. readers never see
+ *  a partially written page
+ */
+void write_atomically(const QString &full_name, const QByteArray &data)
 {
-  size_t r = 0;
-  foreach (const Parameter &p, parameters) {
-    size_t x = p.name.size();
-    if (x > r)
-      r = x;
+  QString tmp_name(temp_name(full_name));
+  QFile file(tmp_name);
+  open_for_writing(file, tmp_name);
+  if (file.write(data) != data.size() || !file.flush()) {
+    QString m("Writing failed: ");
+    m += tmp_name;
+    m += " (";
+    m += file.errorString();
+    m += ")";
+    file.close();
+    file.remove();
+    throw runtime_error(m.toUtf8().data());
+  }
+  file.close();
+  // QFile::rename() refuses to replace an existing file
+  if (::rename(QFile::encodeName(tmp_name).data(),
+        QFile::encodeName(full_name).data())) {
+    QString m("Renaming failed: ");
+    m += tmp_name;
+    file.remove();
+    throw runtime_error(m.toUtf8().data());
   }
-  return r;
 }
 
-void print_brief(QTextStream &o, size_t w, const Parameter &p)
+/** Compresses data into the gzip format
+ *
+ * The header has no timestamp, thus the output is reproducible.
+ */
+QByteArray gzip(const QByteArray &data)
 {
-  if (p.brief_desc.isEmpty())
-    return;
-  size_t used = p.name.size();
-  QString wstr(w > used ? (w-used) : 0, ' ');
-  o << wstr << " // " << p.brief_desc;
-
+  z_stream z;
+  memset(&z, 0, sizeof z);
+  // 16: gzip wrapper instead of zlib
+  if (deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9,
+        Z_DEFAULT_STRATEGY) != Z_OK)
+    throw runtime_error("deflateInit2 failed");
+  QByteArray r;
+  r.resize(deflateBound(&z, data.size()) + 32);
+  z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.constData()));
+  z.avail_in = data.size();
+  z.next_out = reinterpret_cast<Bytef*>(r.data());
+  z.avail_out = r.size();
+  int ret = deflate(&z, Z_FINISH);
+  deflateEnd(&z);
+  if (ret != Z_STREAM_END)
+    throw runtime_error("deflate failed");
+  r.resize(z.total_out);
+  return r;
 }
 
-void print_man_function(QTextStream &o, const Function &f, const Header &h,
-    const Options &opts)
-{
-  o << ".\\\" File automatically generated by "
-    << doxy2man::name << doxy2man::ver << '\n';
-  o << ".\\\" Generation date: " << QDate::currentDate().toString() << '\n';
+/** Writes files in the POSIX ustar format, one after the other
+ */
+class Tar {
+  private:
+    QIODevice &out;
+    uint mtime;
+
+    void put(const char *p, qint64 n)
+    {
+      if (out.write(p, n) != n) {
+        QString m("Writing tar failed: ");
+        m += out.errorString();
+        throw runtime_error(m.toUtf8().data());
+      }
+    }
+    void pad(qint64 n)
+    {
+      static const char zeros[512] = { 0 };
+      while (n > 0) {
+        put(zeros, qMin(n, qint64(sizeof zeros)));
+        n -= sizeof zeros;
+      }
+    }
 
-  o << ".TH " << f.name << ' ' << opts.man_section << ' '
-    << QDate::currentDate().toString("yyyy-MM-dd") << " \""
-    << opts.short_pkg << "\" \"" << opts.pkg << "\"\n";
+    static void field(char *dst, size_t n, const QByteArray &s)
+    {
+      memcpy(dst, s.constData(), qMin(size_t(s.size()), n));
+    }
+    static void octal(char *dst, size_t n, qint64 x)
+    {
+      // n-1 digits plus NUL
+      QByteArray s(QByteArray::number(x, 8).rightJustified(n - 1, '0'));
+      field(dst, n - 1, s);
+    }
+  public:
+    Tar(QIODevice &out, const QDate &date)
+      : out(out),
+      mtime((date.toJulianDay() - 2440588) * 86400) // 1970-01-01
+    {
+    }
+    void add(const QString &name, const QByteArray &data)
+    {
+      QByteArray n(name.toUtf8());
+      if (n.size() > 100) {
+        QString m("Name too long for tar: ");
+        m += name;
+        throw runtime_error(m.toUtf8().data());
+      }
+      char h[512];
+      memset(h, 0, sizeof h);
+      field(h, 100, n);
+      octal(h + 100, 8, 0644);
+      octal(h + 108, 8, 0);
+      octal(h + 116, 8, 0);
+      octal(h + 124, 12, data.size());
+      octal(h + 136, 12, mtime);
+      memset(h + 148, ' ', 8); // checksum field counts as spaces
+      h[156] = '0';
+      memcpy(h + 257, "ustar", 6);
+      memcpy(h + 263, "00", 2);
+      field(h + 265, 32, "root");
+      field(h + 297, 32, "root");
+      unsigned sum = 0;
+      for (size_t i = 0; i < sizeof h; ++i)
+        sum += static_cast<unsigned char>(h[i]);
+      QByteArray s(QByteArray::number(sum, 8).rightJustified(6, '0'));
+      memcpy(h + 148, s.constData(), 6);
+      h[154] = 0;
+      h[155] = ' ';
+      put(h, sizeof h);
+      put(data.constData(), data.size());
+      pad((512 - data.size() % 512) % 512);
+    }
+    /** Appends the end-of-archive marker */
+    void finish()
+    {
+      pad(1024);
+    }
+};
 
-  o << ".SH \"NAME\"\n"
-    << f.name << " \\- " << first_line(f.brief_desc) << '\n';
+struct Write_Job {
+  QString filename;
+  QByteArray data;
+};
 
-  o << ".SH SYNOPSIS\n";
-  o << ".nf\n"; // no filling of output lines
-  o << ".B #include <" << opts.include_prefix << h.name << ">\n";
-  o << ".sp\n"; // space line
+/** Bounded queue of files to write
+ *
+ * Renderers block in push() when it is full, thus at most CAPACITY
+ * rendered pages wait for the disk. The writers take() batches.
+ */
+class Write_Queue {
+  private:
+    enum { CAPACITY = 256 };
+    QVector<Write_Job> jobs;
+    int busy; // jobs taken but not yet written
+    bool closed;
+    QMutex mutex;
+    QWaitCondition not_full;
+    QWaitCondition not_empty;
+    QWaitCondition idle;
+    QString error;
+  public:
+    Write_Queue()
+      : busy(0), closed(false)
+    {
+    }
+    void push(const QString &filename, const QByteArray &data)
+    {
+      QMutexLocker locker(&mutex);
+      while (jobs.size() >= CAPACITY)
+        not_full.wait(&mutex);
+      Write_Job job;
+      job.filename = filename;
+      job.data = data;
+      jobs.push_back(job);
+      not_empty.wakeOne();
+    }
+    /** Returns false when closed and empty */
+    bool take(QVector<Write_Job> &batch, int max)
+    {
+      QMutexLocker locker(&mutex);
+      while (jobs.isEmpty() && !closed)
+        not_empty.wait(&mutex);
+      if (jobs.isEmpty())
+        return false;
+      int n = qMin(max, jobs.size());
+      batch = jobs.mid(0, n);
+      jobs.remove(0, n);
+      busy += n;
+      not_full.wakeAll();
+      return true;
+    }
+    void done(int n, const QString &e)
+    {
+      QMutexLocker locker(&mutex);
+      busy -= n;
+      if (error.isEmpty())
+        error = e;
+      if (jobs.isEmpty() && !busy)
+        idle.wakeAll();
+    }
+    /** Waits until everything is written, throws the first error */
+    void flush()
+    {
+      QMutexLocker locker(&mutex);
+      while (!jobs.isEmpty() || busy)
+        idle.wait(&mutex);
+      if (!error.isEmpty()) {
+        QString e(error);
+        error.clear();
+        throw runtime_error(e.toUtf8().data());
+      }
+    }
+    void close()
+    {
+      QMutexLocker locker(&mutex);
+      closed = true;
+      not_empty.wakeAll();
+    }
+};
 
+#ifdef DOXY2MAN_IO_URING
+/** Writes a batch with a few io_uring submissions
+ *
+ * All temporary files of a batch are opened at once, then written and
+ * closed, then renamed, i.e. the kernel overlaps the metadata
+ * operations. Without renameat support the written files are renamed
+ * with rename(). A file whose write or close fails is written with
+ * write_atomically() instead, which also reports the error; its
+ * temporary file is removed.
+ */
+class Uring_Backend {
+  private:
+    enum { DEPTH = 64 };
+    struct io_uring ring;
+    bool rename_supported; // IORING_OP_RENAMEAT, i.e. Linux >= 5.11
 
-  o << "\\fB" << f.type << ' ' << f.name << "\\fP(\n";
-  size_t w = get_type_width(f.parameters);
-  size_t param_size = max_param_size(f.parameters);
-  QVectorIterator<Parameter> i(f.parameters);
-  Parameter a;
-  if (i.hasNext()) {
-    a = i.next();
-    // bold face, previous selected face
-    o << "    \\fB" << fill_right(a.type, w) << "\\fP\\fI" << a.name << "\\fP";
-  }
-  if (!i.hasNext()) {
-    print_brief(o, param_size, a);
-  } else while (i.hasNext()) {
-    o << ",";
-    print_brief(o, param_size, a);
-    o << '\n';
-    a = i.next();
-    o << "    \\fB" << fill_right(a.type, w) << "\\fP\\fI" << a.name << "\\fP";
-  }
-  o << "\n);\n";
+    Uring_Backend(const Uring_Backend &);
+    Uring_Backend &operator=(const Uring_Backend &);
 
-  o << ".fi\n"; // fill output lines
+    /** Submits the prepared entries and collects n results by user_data */
+    void run(QVector<int> &results, unsigned n)
+    {
+      io_uring_submit_and_wait(&ring, n);
+      for (unsigned i = 0; i < n; ++i) {
+        struct io_uring_cqe *cqe;
+        if (io_uring_wait_cqe(&ring, &cqe) < 0)
+          throw runtime_error("io_uring_wait_cqe failed");
+        results[cqe->user_data] = cqe->res;
+        io_uring_cqe_seen(&ring, cqe);
+      }
+    }
+  public:
+    enum { BATCH = DEPTH / 2 }; // write and close per file
+    Uring_Backend()
+      : rename_supported(true)
+    {
+      if (io_uring_queue_init(DEPTH, &ring, 0) < 0)
+        throw runtime_error("io_uring_queue_init failed");
+    }
+    ~Uring_Backend()
+    {
+      io_uring_queue_exit(&ring);
+    }
+    void write(const QVector<Write_Job> &batch)
+    {
+      int n = batch.size();
+      QVector<QByteArray> tmp_names(n), names(n);
+      for (int i = 0; i < n; ++i) {
+        names[i] = QFile::encodeName(batch[i].filename);
+        tmp_names[i] = QFile::encodeName(temp_name(batch[i].filename));
+      }
+      QVector<bool> failed(n, false);
 
+      QVector<int> fds(n);
+      for (int i = 0; i < n; ++i) {
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+        io_uring_prep_openat(sqe, AT_FDCWD, tmp_names[i].constData(),
+            O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        sqe->user_data = i;
+      }
+      run(fds, n);
 
-  o << ".SH DESCRIPTION\n";
-  QStringList paras = f.desc.split("\n", QString::SkipEmptyParts);
-  foreach (const QString p, paras) {
-    o << ".PP \n"; // line break, vert space, restore left margin/indent
-    o << p << '\n';
-  }
+      QVector<int> results(2 * n);
+      unsigned k = 0;
+      for (int i = 0; i < n; ++i) {
+        if (fds[i] < 0) {
+          failed[i] = true;
+          continue;
+        }
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+        io_uring_prep_write(sqe, fds[i], batch[i].data.constData(),
+            batch[i].data.size(), 0);
+        sqe->flags |= IOSQE_IO_LINK;
+        sqe->user_data = 2 * i;
+        sqe = io_uring_get_sqe(&ring);
+        io_uring_prep_close(sqe, fds[i]);
+        sqe->user_data = 2 * i + 1;
+        k += 2;
+      }
+      run(results, k);
 
-  if (f.has_detailed_param_desc()) {
-    o << ".SH PARAMETERS\n";
-    foreach (const Parameter &p, f.parameters) {
-      o << ".TP\n"; // indented labeled paragraph, next line is label
-      o << ".B "; // bold face
-      o << p.name << '\n';
-      if (p.desc.isEmpty())
-        o << p.brief_desc;
-      else
-        o << p.desc;
-      o << '\n';
-    }
-  }
+      k = 0;
+      for (int i = 0; i < n; ++i) {
+        if (failed[i])
+          continue;
+        // the close was canceled because the write failed, any other
+        // error means the kernel already released the descriptor
+        if (results[2 * i + 1] == -ECANCELED)
+          ::close(fds[i]);
+        if (results[2 * i] != batch[i].data.size() || results[2 * i + 1] < 0) {
+          ::unlink(tmp_names[i].constData());
+          failed[i] = true;
+          continue;
+        }
+        if (!rename_supported)
+          continue;
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+        io_uring_prep_renameat(sqe, AT_FDCWD, tmp_names[i].constData(),
+            AT_FDCWD, names[i].constData(), 0);
+        sqe->user_data = i;
+        ++k;
+      }
+      QVector<int> renamed(n, -EINVAL);
+      if (rename_supported)
+        run(renamed, k);
 
-  if (opts.enable_structs && !f.ref_ids.isEmpty()) {
-    o << ".SH STRUCTURES\n";
-    try {
-    foreach (const QString &ref_id, f.ref_ids) {
-      const Struct &s = h.struct_by_id(ref_id);
-      print_struct(o, s);
+      for (int i = 0; i < n; ++i) {
+        if (failed[i]) {
+          write_atomically(batch[i].filename, batch[i].data);
+          continue;
+        }
+        if (!renamed[i])
+          continue;
+        // e.g. Linux < 5.11, the data is on disk already, though
+        if (renamed[i] == -EINVAL)
+          rename_supported = false;
+        if (::rename(tmp_names[i].constData(), names[i].constData())) {
+          ::unlink(tmp_names[i].constData());
+          write_atomically(batch[i].filename, batch[i].data);
+        }
+      }
     }
-    } catch (const range_error &r) {
-      cerr << "Warning: could not find referenced structure: " << r.what() << "(in "
-        << f.name << ")\n";
+};
+#else
+class Uring_Backend {
+  public:
+    enum { BATCH = 32 };
+    void write(const QVector<Write_Job> &batch)
+    {
+      foreach (const Write_Job &job, batch)
+        write_atomically(job.filename, job.data);
     }
-  }
+};
+#endif
 
-  if (!f.return_desc.isEmpty() || !f.ret_values.isEmpty()) {
-    o << ".SH RETURN VALUE\n";
-    if (!f.return_desc.isEmpty()) {
+/** Drains the write queue
+ *
+ * Without io_uring (i.e. DOXY2MAN_IO_URING isn't defined, see main.pro)
+ * the writer threads work as a pool that writes one file after the
+ * other.
+ */
+class Writer_Thread : public QThread {
+  private:
+    Write_Queue &queue;
+  public:
+    Writer_Thread(Write_Queue &queue)
+      : queue(queue)
+    {
+    }
+    void run()
+    {
+      QScopedPointer<Uring_Backend> backend;
+      try {
+        backend.reset(new Uring_Backend);
+      } catch (const exception &e) {
+        // e.g. io_uring is disabled by the kernel, thus write one file
+        // after the other
+        static QAtomicInt warned;
+        if (warned.testAndSetOrdered(0, 1))
+          cerr << "Warning: " << e.what() << ", writing without io_uring\n";
+      }
+      QVector<Write_Job> batch;
+      while (queue.take(batch, Uring_Backend::BATCH)) {
+        QString e;
+        try {
+          if (backend)
+            backend->write(batch);
+          else
+            foreach (const Write_Job &job, batch)
+              write_atomically(job.filename, job.data);
+        } catch (const exception &x) {
+          e = x.what();
+        }
+        queue.done(batch.size(), e);
+      }
+    }
+};
+
+/** Writes pages into the output directory, but only if they changed
+ *
+ * The output directory contains a manifest that lists the content hash
+ * of each page and the header it was generated from. Thus, unchanged
+ * pages keep their mtime and pages of a header that are not generated
+ * anymore can be removed.
+ *
+ * With --tar the pages are appended to the archive as soon as their
+ * header is done, in the order given by set_order() and sorted by name
+ * within a header, thus the archive doesn't depend on the order the
+ * worker threads finish in.
+ *
+ * write() may be called from several threads.
+ */
+class Page_Writer {
+  private:
+    struct Entry {
+      QByteArray hash;
+      QString owner;
+    };
+    const Options &opts;
+    QString manifest_filename;
+    QMap<QString, Entry> old_entries;
+    QMap<QString, Entry> entries;
+    QSet<QString> present; // files in the output directory
+    QSet<QString> owners;
+    QStringList added;
+    QStringList changed;
+    QStringList generated;
+    typedef QMap<QString, QByteArray> Bundle; // pages by name, for --tar
+    QMap<QString, Bundle> pending; // by owner
+    QMap<int, Bundle> ready; // by position of the header
+    QHash<QString, int> order; // position by input filename
+    int next; // position of the next header to append
+    QSet<QString> bundled;
+    QFile tar_file;
+    QString tar_tmp_name;
+    QScopedPointer<Tar> tar;
+    QMutex mutex;
+    Write_Queue queue;
+    QVector<Writer_Thread*> threads;
+
+    void read_manifest()
+    {
+      QFile file(manifest_filename);
+      if (!file.open(QIODevice::ReadOnly))
+        return;
+      while (!file.atEnd()) {
+        QList<QByteArray> fields(file.readLine().trimmed().split(' '));
+        if (fields.size() != 3)
+          continue;
+        Entry e;
+        e.hash = QByteArray::fromHex(fields[0]);
+        e.owner = QString::fromUtf8(fields[1]);
+        old_entries[QString::fromUtf8(fields[2])] = e;
+      }
+    }
+    /** Lists the output directory once, i.e. write() doesn't have to
+     *  stat each page */
+    void read_present()
+    {
+      foreach (const QString &name,
+          opts.output_dir.entryList(QDir::Files))
+        present.insert(name);
+    }
+    void write_manifest()
+    {
+      QByteArray data;
+      for (QMap<QString, Entry>::const_iterator i = entries.constBegin();
+          i != entries.constEnd(); ++i) {
+        data += i.value().hash.toHex();
+        data += ' ';
+        data += i.value().owner.toUtf8();
+        data += ' ';
+        data += i.key().toUtf8();
+        data += '\n';
+      }
+      write_atomically(manifest_filename, data);
+    }
+    static void print_list(ostream &o, const char *what, const QStringList &l)
+    {
+      foreach (const QString &name, l)
+        o << what << ": " << name << '\n';
+    }
+    void open_tar()
+    {
+      if (opts.tar_path == "-") {
+        if (!tar_file.open(stdout, QIODevice::WriteOnly))
+          throw runtime_error("Opening stdout for the tar failed");
+      } else {
+        tar_tmp_name = temp_name(opts.tar_path);
+        tar_file.setFileName(tar_tmp_name);
+        open_for_writing(tar_file, tar_tmp_name);
+      }
+      tar.reset(new Tar(tar_file, opts.date));
+    }
+    /** Directory of a page in the tar file, i.e. man3/ for man pages and
+     *  markdown/, html/ or json/ for the other formats
+     */
+    QString tar_dir(const QString &name) const
+    {
+      QString plain_name(name);
+      if (opts.gzip)
+        plain_name.chop(3);
+      QString ext(plain_name.section('.', -1));
+      if (ext == opts.man_section)
+        return "man" + ext + "/";
+      if (ext == "md")
+        return "markdown/";
+      if (ext == "jsonl")
+        return "json/";
+      return ext + "/";
+    }
+    void append(const Bundle &b)
+    {
+      if (!tar)
+        return; // i.e. --dry-run
+      for (Bundle::const_iterator i = b.constBegin(); i != b.constEnd(); ++i)
+        tar->add(tar_dir(i.key()) + i.key(), i.value());
+    }
+    void finish_tar()
+    {
+      for (QMap<int, Bundle>::const_iterator i = ready.constBegin();
+          i != ready.constEnd(); ++i)
+        append(i.value());
+      ready.clear();
+      // e.g. struct pages, which belong to no header
+      for (QMap<QString, Bundle>::const_iterator i = pending.constBegin();
+          i != pending.constEnd(); ++i)
+        append(i.value());
+      pending.clear();
+      if (!tar)
+        return;
+      tar->finish();
+      if (!tar_file.flush()) {
+        QString m("Writing tar failed: ");
+        m += opts.tar_path;
+        throw runtime_error(m.toUtf8().data());
+      }
+      if (tar_tmp_name.isEmpty())
+        return;
+      tar_file.close();
+      // QFile::rename() refuses to replace an existing file
+      if (::rename(QFile::encodeName(tar_tmp_name).data(),
+            QFile::encodeName(opts.tar_path).data())) {
+        QString m("Renaming failed: ");
+        m += tar_tmp_name;
+        throw runtime_error(m.toUtf8().data());
+      }
+      tar_tmp_name.clear();
+    }
+  public:
+    Page_Writer(const Options &opts)
+      : opts(opts),
+      manifest_filename(opts.output_dir.path() + "/.doxy2man-manifest"),
+      next(0)
+    {
+      // i.e. shards sharing the output directory keep their pages apart
+      if (opts.shard_count > 1)
+        manifest_filename += QString(".%1-of-%2")
+          .arg(opts.shard_index).arg(opts.shard_count);
+      if (!opts.tar_path.isEmpty()) {
+        if (!opts.dry_run)
+          open_tar();
+        return;
+      }
+      read_manifest();
+      read_present();
+      if (opts.dry_run)
+        return;
+      for (int i = 0; i < opts.io_threads; ++i) {
+        threads.push_back(new Writer_Thread(queue));
+        threads.last()->start();
+      }
+    }
+    ~Page_Writer()
+    {
+      queue.close();
+      foreach (Writer_Thread *t, threads) {
+        t->wait();
+        delete t;
+      }
+      // i.e. finish() wasn't reached
+      if (!tar_tmp_name.isEmpty()) {
+        tar_file.close();
+        tar_file.remove();
+      }
+    }
+
+    /** Writes the page name, generated from the header owner
+     *
+     * Called from the worker threads, thus compression happens there,
+     * too.
+     */
+    void write(const QString &owner, const QString &plain_name,
+        const QByteArray &page)
+    {
+      QString name(file_name(plain_name));
+      QByteArray data(opts.gzip ? ::gzip(page) : page);
+      if (!opts.tar_path.isEmpty()) {
+        QMutexLocker locker(&mutex);
+        pending[owner][name] = data;
+        bundled.insert(name);
+        stats.add(Stats::PAGES_WRITTEN);
+        stats.add(Stats::BYTES_WRITTEN, data.size());
+        return;
+      }
+
+      Entry e;
+      e.hash = QCryptographicHash::hash(data, QCryptographicHash::Sha1);
+      e.owner = owner;
+      QString full_name(opts.output_dir.path() + QDir::separator() + name);
+      // present and old_entries are only modified between passes
+      bool exists = present.contains(name);
+      bool unchanged = exists && old_entries.value(name).hash == e.hash;
+      if (!unchanged && !opts.dry_run) {
+        if (threads.isEmpty())
+          write_atomically(full_name, data);
+        else
+          queue.push(full_name, data);
+      }
+      if (unchanged) {
+        stats.add(Stats::PAGES_UNCHANGED);
+      } else {
+        stats.add(Stats::PAGES_WRITTEN);
+        stats.add(Stats::BYTES_WRITTEN, data.size());
+      }
+
+      QMutexLocker locker(&mutex);
+      entries[name] = e;
+      owners.insert(owner);
+      generated << full_name;
+      if (!exists)
+        added << name;
+      else if (!unchanged)
+        changed << name;
+    }
+
+    QString file_name(const QString &plain_name) const
+    {
+      return opts.gzip ? plain_name + ".gz" : plain_name;
+    }
+
+    /** True if the page was already written in this pass */
+    bool contains(const QString &plain_name)
+    {
+      QString name(file_name(plain_name));
+      QMutexLocker locker(&mutex);
+      return entries.contains(name) || bundled.contains(name);
+    }
+
+    /** Sets the order of the headers in the tar file, by input filename */
+    void set_order(const QStringList &filenames)
+    {
+      for (int i = 0; i < filenames.size(); ++i)
+        order[filenames[i]] = i;
+    }
+
+    /** Called on the main thread once all pages of h are written
+     *
+     * With --tar, appends them and those of the following headers that
+     * are already done.
+     */
+    void header_done(const Header &h)
+    {
+      if (opts.tar_path.isEmpty() || !order.contains(h.filename))
+        return;
+      {
+        QMutexLocker locker(&mutex);
+        ready[order[h.filename]] = pending.take(h.name);
+      }
+      while (ready.contains(next))
+        append(ready.take(next++));
+    }
+
+    /** Marks owner as generated in this pass, even if none of its pages
+     *  is written, e.g. because they belong to other shards */
+    void claim(const QString &owner)
+    {
+      QMutexLocker locker(&mutex);
+      owners.insert(owner);
+    }
+
+    /** Keeps the pages of owner that aren't written in this pass, i.e.
+     *  when only some of its pages are regenerated */
+    void partial(const QString &owner)
+    {
+      owners.remove(owner);
+    }
+
+    /** Starts the next pass, after finish() */
+    void restart()
+    {
+      if (!opts.dry_run)
+        foreach (const QString &name, entries.keys())
+          present.insert(name);
+      old_entries = entries;
+      entries.clear();
+      owners.clear();
+      added.clear();
+      changed.clear();
+      generated.clear();
+    }
+
+    /** Pages written (or checked to be unchanged) in this run, plus
+     *  the manifest */
+    QStringList outputs() const
+    {
+      if (!opts.tar_path.isEmpty())
+        return QStringList(opts.tar_path);
+      QStringList r(generated);
+      r.sort();
+      r.prepend(manifest_filename);
+      return r;
+    }
+
+    /** Removes stale pages, updates the manifest and lists the changes */
+    void finish()
+    {
+      if (!opts.tar_path.isEmpty()) {
+        finish_tar();
+        return;
+      }
+      queue.flush();
+      QStringList removed;
+      for (QMap<QString, Entry>::const_iterator i = old_entries.constBegin();
+          i != old_entries.constEnd(); ++i) {
+        if (entries.contains(i.key()))
+          continue;
+        if (owners.contains(i.value().owner))
+          removed << i.key();
+        else
+          entries[i.key()] = i.value();
+      }
+      if (opts.dry_run || opts.list_changes) {
+        added.sort();
+        changed.sort();
+        print_list(cout, "added", added);
+        print_list(cout, "changed", changed);
+        print_list(cout, "removed", removed);
+      }
+      if (opts.dry_run)
+        return;
+      foreach (const QString &name, removed) {
+        QFile::remove(opts.output_dir.path() + QDir::separator() + name);
+        present.remove(name);
+      }
+      write_manifest();
+    }
+};
+
+size_t max_param_size(const QVector<Parameter> &parameters)
+{
+  size_t r = 0;
+  foreach (const Parameter &p, parameters) {
+    size_t x = p.name.size();
+    if (x > r)
+      r = x;
+  }
+  return r;
+}
+
+void print_brief(Roff &o, size_t w, const Parameter &p)
+{
+  if (p.brief_desc.isEmpty())
+    return;
+  size_t used = p.name.size();
+  o.pad(w > used ? (w-used) : 0);
+  o << " // " << p.brief_desc;
+
+}
+
+/** Appends the indices of the functions listed under see also of f
+ *
+ * That is all functions of h in sort order, or at most --seealso-max
+ * related ones.
+ */
+void see_also_functions(const Function &f, const Header &h,
+    const Options &opts, QVector<int> &r)
+{
+  if (!opts.enable_seealso_all)
+    return;
+  if (opts.seealso_max && h.functions.size() - 1 > opts.seealso_max)
+    h.related(f, opts.seealso_max, r);
+  else
+    r += h.sorted_index;
+}
+
+void print_man_function(Roff &o, const Function &f, const Header &h,
+    const Options &opts)
+{
+  o.title(f.name, opts);
+
+  o.section("\"NAME\"");
+  o << f.name << " \\- ";
+  o.first_line(f.brief_desc);
+  o << '\n';
+
+  o.section("SYNOPSIS");
+  o << ".nf\n"; // no filling of output lines
+  o << ".B #include <" << opts.include_prefix << h.name << ">\n";
+  o << ".sp\n"; // space line
+
+
+  o << "\\fB" << f.type << ' ' << f.name << "\\fP(\n";
+  size_t w = get_type_width(f.parameters);
+  size_t param_size = max_param_size(f.parameters);
+  int n = f.parameters.size();
+  for (int i = 0; i < n; ++i) {
+    const Parameter &a = f.parameters[i];
+    // bold face, previous selected face
+    o << "    \\fB";
+    o.fill_right(a.type, w);
+    o << "\\fP\\fI" << a.name << "\\fP";
+    // the brief description of the last one is only printed
+    // if it is the only one
+    if (i+1 < n) {
+      o << ",";
+      print_brief(o, param_size, a);
+      o << '\n';
+    } else if (n == 1) {
+      print_brief(o, param_size, a);
+    }
+  }
+  o << "\n);\n";
+
+  o << ".fi\n"; // fill output lines
+
+
+  o.section("DESCRIPTION");
+  o.paragraphs(f.desc);
+
+  if (f.has_detailed_param_desc()) {
+    o.section("PARAMETERS");
+    foreach (const Parameter &p, f.parameters) {
+      o.tagged(p.name);
+      if (p.desc.isEmpty())
+        o << p.brief_desc;
+      else
+        o << p.desc;
+      o << '\n';
+    }
+  }
+
+  if (opts.enable_structs && !f.ref_ids.isEmpty()) {
+    o.section("STRUCTURES");
+    if (opts.struct_so)
+      o << ".nr d2 1\n"; // hides the title of the struct pages
+    try {
+    foreach (const QString &ref_id, f.ref_ids) {
+      const Struct &s = h.struct_by_id(ref_id);
+      if (opts.struct_so) {
+        // the real file name, thus with --gzip only man-db finds it
+        o << ".so man" << opts.man_section << '/'
+          << struct_page_name(s, opts) << (opts.gzip ? ".gz" : "") << '\n';
+      } else {
+        print_struct(o, s);
+      }
+    }
+    } catch (const range_error &r) {
+      cerr << "Warning: could not find referenced structure: " << r.what() << "(in "
+        << f.name << ")\n";
+    }
+  }
+
+  if (!f.return_desc.isEmpty() || !f.ret_values.isEmpty()) {
+    o.section("RETURN VALUE");
+    if (!f.return_desc.isEmpty()) {
       o << ".PP\n";
       o << f.return_desc << '\n';
     }
     foreach (const Parameter &p, f.ret_values) {
-      o << ".TP\n"; // indented labeled paragraph, next line is label
-      o << ".B "; // bold face
-      o << p.name << '\n';
+      o.tagged(p.name);
       o << p.desc << '\n';
     }
   }
 
-  o << ".SH SEE ALSO\n";
+  o.section("SEE ALSO");
   o << ".PP\n"; // 'paragraph'
   o << ".nh\n"; // disable hyphenation
   o << ".ad l\n"; // left justified
-  o << "\\fI" << h.name << "\\fP(" << opts.man_section << ")";
-  if (opts.enable_seealso_all) {
-    foreach (const Function &i, h.functions_sorted) {
-      o << ", ";
-      o << "\\fI" << i.name << "\\fP(" << opts.man_section << ")";
-    }
+  o.man_ref(h.name, opts);
+  QVector<int> related;
+  see_also_functions(f, h, opts, related);
+  foreach (int k, related) {
+    o << ", ";
+    o.man_ref(h.functions[k].name, opts);
   }
   foreach (const See_Also &see, f.see_also) {
     o << ", " << "\\fI" << see.name << "\\fP";
@@ -852,7 +2727,7 @@ void print_man_function(QTextStream &o, const Function &f, const Header &h,
   o << ".hy\n"; // enable hyphenation
 
   if (!f.authors.isEmpty()) {
-    o << ".SH AUTHORS\n";
+    o.section("AUTHORS");
     o << ".nf\n"; // no filling of output lines
     foreach (const QString &author, f.authors)
       o << author << '\n';
@@ -861,7 +2736,7 @@ void print_man_function(QTextStream &o, const Function &f, const Header &h,
 
   if (opts.enable_copyright
       &&(!f.copyright.isEmpty() || !h.copyright.isEmpty())) {
-    o << ".SH COPYRIGHT\n";
+    o.section("COPYRIGHT");
     o << ".PP\n"; // paragraph
     if (f.copyright.isEmpty())
       o << h.copyright << '\n';
@@ -871,464 +2746,2960 @@ void print_man_function(QTextStream &o, const Function &f, const Header &h,
 }
 
 
-void print_man(const Header &h, const Options &opts)
-{
-  print_man_summary_page(h, opts);
+class Man_Renderer : public Renderer {
+  public:
+    const char *name() const
+    {
+      return "man";
+    }
+    QString page_name(const QString &name, const Options &opts) const
+    {
+      return ::page_name(name, opts);
+    }
+    bool struct_pages(const Options &opts) const
+    {
+      return opts.struct_so;
+    }
+    QByteArray summary(const Header &h, const Options &opts) const
+    {
+      Roff o;
+      print_man_summary(o, h, opts);
+      return o.data();
+    }
+    QByteArray function(const Function &f, const Header &h,
+        const Options &opts) const
+    {
+      Roff o;
+      print_man_function(o, f, h, opts);
+      return o.data();
+    }
+    QByteArray structure(const Struct &s, const Options &opts) const
+    {
+      Roff o;
+      o << ".\\\" File automatically generated by "
+        << doxy2man::name << doxy2man::ver << '\n';
+      // a function page that includes this one with .so sets d2, then
+      // its own title and sections stay in place
+      o << ".if !\\n(d2 \\{\\\n";
+      o.th("struct_" + s.name, opts);
+      o.section("\"NAME\"");
+      o << "struct_" << s.name << " \\- ";
+      o.first_line(s.brief_desc);
+      o << '\n';
+      o.section("DESCRIPTION");
+      o << ".\\}\n";
+      print_struct(o, s);
+      return o.data();
+    }
+};
 
-  foreach (const Function &f, h.functions) {
-    QString page_name(f.name);
-    page_name += '.';
-    page_name += opts.man_section;
-    QString full_name(opts.output_dir.path() + QDir::separator() + page_name);
-    QFile file(full_name);
-    open_for_writing(file, full_name);
-    QTextStream o(&file);
+/** Common layout of the document formats, i.e. a page consists of
+ *  headings, paragraphs, code blocks and lists
+ */
+class Doc_Renderer : public Renderer {
+  protected:
+    virtual Page_Buffer::Escaping escaping() const = 0;
+    virtual void begin(Page_Buffer &o, const QString &title,
+        const Options &opts) const = 0;
+    virtual void end(Page_Buffer &o, const Options &opts) const = 0;
+    virtual void heading(Page_Buffer &o, int level,
+        const QString &text) const = 0;
+    virtual void paragraphs(Page_Buffer &o, const QString &s) const = 0;
+    virtual void begin_code(Page_Buffer &o) const = 0;
+    virtual void end_code(Page_Buffer &o) const = 0;
+    virtual void code(Page_Buffer &o, const QString &name) const = 0;
+    virtual void begin_list(Page_Buffer &o) const = 0;
+    virtual void item(Page_Buffer &o) const = 0;
+    virtual void end_item(Page_Buffer &o) const = 0;
+    virtual void end_list(Page_Buffer &o) const = 0;
+    virtual void link(Page_Buffer &o, const QString &name,
+        const Options &opts) const = 0;
 
-    print_man_function(o, f, h, opts);
+    void include(Page_Buffer &o, const Header &h, const Options &opts) const
+    {
+      o << "#include <" << opts.include_prefix << h.name << ">\n";
+    }
+    void structure_section(Page_Buffer &o, const Struct &s) const
+    {
+      heading(o, 3, "struct " + s.name);
+      paragraphs(o, s.brief_desc);
+      paragraphs(o, s.desc);
+      begin_code(o);
+      o << "struct " << s.name << " {\n";
+      size_t w = get_type_width(s.members);
+      foreach (const Member &m, s.members) {
+        o << "  ";
+        o.fill_right(m.type, w);
+        o << m.name << m.arg_string << ";\n";
+      }
+      o << "};\n";
+      end_code(o);
+      bool briefs = false;
+      foreach (const Member &m, s.members) {
+        if (m.brief_desc.isEmpty())
+          continue;
+        if (!briefs)
+          begin_list(o);
+        briefs = true;
+        item(o);
+        code(o, m.name);
+        o << ": ";
+        o.first_line(m.brief_desc);
+        end_item(o);
+      }
+      if (briefs)
+        end_list(o);
+    }
+    template <typename List>
+    void authors(Page_Buffer &o, const List &authors) const
+    {
+      if (authors.isEmpty())
+        return;
+      heading(o, 2, "Authors");
+      begin_list(o);
+      foreach (const QString &author, authors) {
+        item(o);
+        o << author;
+        end_item(o);
+      }
+      end_list(o);
+    }
+    void copyright(Page_Buffer &o, const QString &copyright,
+        const Options &opts) const
+    {
+      if (!opts.enable_copyright || copyright.isEmpty())
+        return;
+      heading(o, 2, "Copyright");
+      paragraphs(o, copyright);
+    }
+  public:
+    QByteArray summary(const Header &h, const Options &opts) const
+    {
+      Page_Buffer o(escaping());
+      begin(o, h.name, opts);
+      heading(o, 1, h.name);
+      paragraphs(o, h.brief_desc);
 
-    flush_stream(o, full_name);
-    file.close();
-  }
-}
+      heading(o, 2, "Synopsis");
+      begin_code(o);
+      include(o, h, opts);
+      o << '\n';
+      size_t w = get_type_width(h.functions);
+      for (int k = 0; k < h.functions.size(); ++k) {
+        const Function &f = h.sorted(k);
+        o.fill_right(f.type, w);
+        o << f.name << '(';
+        for (int i = 0; i < f.parameters.size(); ++i) {
+          if (i)
+            o << ", ";
+          o << f.parameters[i].type;
+        }
+        o << ");\n";
+      }
+      end_code(o);
 
-enum Tag {
-  TAG_IGNORE,
-  TAG_SECTIONDEF_ENUM,
-  TAG_SECTIONDEF_TYPEDEF,
-  TAG_SECTIONDEF_FUNC,
-  TAG_SECTIONDEF_DEFINE,
-  TAG_MEMBERDEF_ENUM,
-  TAG_MEMBERDEF_TYPDEF,
-  TAG_MEMBERDEF_FUNC,
-  TAG_MEMBERDEF_DEFINE,
-  TAG_MEMBERDEF_VAR,
-  TAG_NAME,
-  TAG_ENUMVALUE,
-  TAG_BRIEFDESC,
-  TAG_DETAILDESC,
-  TAG_TYPE,
-  TAG_DEFINITION,
-  TAG_ARGSTRING,
-  TAG_PARAM,
-  TAG_DECLNAME,
-  TAG_COMPOUNDNAME,
-  TAG_LINEBREAK,
-  TAG_SIMPLESECT_AUTHOR,
-  TAG_SIMPLESECT_RETURN,
-  TAG_SIMPLESECT_COPYRIGHT,
-  TAG_SIMPLESECT_SEE,
-  TAG_PARAMETERLIST, // kind == param
-  TAG_RETVALLIST, // fake parameterlist && kind == param
-  TAG_PARAMETERNAME,
-  TAG_PARAMETERDESC,
-  TAG_PARAMETERITEM,
-  TAG_REF, // refid xml file
-  TAG_REF_MEMBER, // inline function ref (in briefdesc)
-  TAG_COMPOUNDDEF_FILE,
-  TAG_COMPOUNDDEF_STRUCT,
-  TAG_ULINK, // mailto link ...
-  TAG_PARA // paragraph
-};
+      heading(o, 2, "Description");
+      paragraphs(o, h.desc);
 
-class Handler : public QXmlDefaultHandler
-{
-  public:
-    Header &h;
-  private:
-    Tag tag;
-  public:
-    Handler(Header &header)
-      : h(header), tag(TAG_IGNORE)
-    {
-    }
-  private:
-    Function f;
-    Parameter p;
+      if (!h.structs.isEmpty() || !h.ref_structs.isEmpty()) {
+        heading(o, 2, "Structures");
+        foreach (const Struct &s, h.structs)
+          structure_section(o, s);
+        foreach (const Struct *s, h.ref_structs)
+          structure_section(o, *s);
+      }
+
+      if (!h.functions.isEmpty()) {
+        heading(o, 2, "Functions");
+        begin_list(o);
+        for (int k = 0; k < h.functions.size(); ++k) {
+          const Function &f = h.sorted(k);
+          item(o);
+          link(o, f.name, opts);
+          if (!f.brief_desc.isEmpty()) {
+            o << ": ";
+            o.first_line(f.brief_desc);
+          }
+          end_item(o);
+        }
+        end_list(o);
+      }
+
+      authors(o, extract_authors(h.functions));
+      copyright(o, h.copyright, opts);
+      end(o, opts);
+      return o.data();
+    }
+    QByteArray function(const Function &f, const Header &h,
+        const Options &opts) const
+    {
+      Page_Buffer o(escaping());
+      begin(o, f.name, opts);
+      heading(o, 1, f.name);
+      paragraphs(o, f.brief_desc);
+
+      heading(o, 2, "Synopsis");
+      begin_code(o);
+      include(o, h, opts);
+      o << '\n' << f.type << ' ' << f.name << "(\n";
+      size_t w = get_type_width(f.parameters);
+      for (int i = 0; i < f.parameters.size(); ++i) {
+        const Parameter &a = f.parameters[i];
+        o << "    ";
+        o.fill_right(a.type, w);
+        o << a.name << (i + 1 < f.parameters.size() ? ",\n" : "\n");
+      }
+      o << ");\n";
+      end_code(o);
+
+      heading(o, 2, "Description");
+      paragraphs(o, f.desc);
+
+      if (f.has_detailed_param_desc()) {
+        heading(o, 2, "Parameters");
+        begin_list(o);
+        foreach (const Parameter &p, f.parameters) {
+          item(o);
+          code(o, p.name);
+          o << ": " << (p.desc.isEmpty() ? p.brief_desc : p.desc);
+          end_item(o);
+        }
+        end_list(o);
+      }
+
+      if (opts.enable_structs && !f.ref_ids.isEmpty()) {
+        heading(o, 2, "Structures");
+        foreach (const QString &ref_id, f.ref_ids) {
+          try {
+            structure_section(o, h.struct_by_id(ref_id));
+          } catch (const range_error &) {
+            // the man page warns about it
+          }
+        }
+      }
+
+      if (!f.return_desc.isEmpty() || !f.ret_values.isEmpty()) {
+        heading(o, 2, "Return value");
+        paragraphs(o, f.return_desc);
+        if (!f.ret_values.isEmpty()) {
+          begin_list(o);
+          foreach (const Parameter &p, f.ret_values) {
+            item(o);
+            code(o, p.name);
+            o << ": " << p.desc;
+            end_item(o);
+          }
+          end_list(o);
+        }
+      }
+
+      heading(o, 2, "See also");
+      QVector<int> related;
+      see_also_functions(f, h, opts, related);
+      begin_list(o);
+      item(o);
+      link(o, h.name, opts);
+      end_item(o);
+      foreach (int k, related) {
+        item(o);
+        link(o, h.functions[k].name, opts);
+        end_item(o);
+      }
+      foreach (const See_Also &see, f.see_also) {
+        item(o);
+        code(o, atoms.str(see.name));
+        end_item(o);
+      }
+      end_list(o);
+
+      authors(o, f.authors);
+      copyright(o, f.copyright.isEmpty() ? h.copyright : f.copyright, opts);
+      end(o, opts);
+      return o.data();
+    }
+};
+
+/** CommonMark, e.g. for a static site generator */
+class Markdown_Renderer : public Doc_Renderer {
+  protected:
+    Page_Buffer::Escaping escaping() const
+    {
+      return Page_Buffer::MARKDOWN;
+    }
+    void begin(Page_Buffer &o, const QString &title,
+        const Options &opts) const
+    {
+    }
+    void end(Page_Buffer &o, const Options &opts) const
+    {
+      o << "---\n\n" << opts.pkg << ", " << opts.date.toString("yyyy-MM-dd")
+        << '\n';
+    }
+    void heading(Page_Buffer &o, int level, const QString &text) const
+    {
+      o << QByteArray(level, '#').constData() << ' ' << text << "\n\n";
+    }
+    void paragraphs(Page_Buffer &o, const QString &s) const
+    {
+      o.paragraphs(s, "", "\n\n");
+    }
+    void begin_code(Page_Buffer &o) const
+    {
+      o << "```c\n";
+      o.set_escaping(Page_Buffer::RAW);
+    }
+    void end_code(Page_Buffer &o) const
+    {
+      o.set_escaping(Page_Buffer::MARKDOWN);
+      o << "```\n\n";
+    }
+    void code(Page_Buffer &o, const QString &name) const
+    {
+      o.set_escaping(Page_Buffer::RAW);
+      o << '`' << name << '`';
+      o.set_escaping(Page_Buffer::MARKDOWN);
+    }
+    void begin_list(Page_Buffer &o) const
+    {
+    }
+    void item(Page_Buffer &o) const
+    {
+      o << "- ";
+    }
+    void end_item(Page_Buffer &o) const
+    {
+      o << '\n';
+    }
+    void end_list(Page_Buffer &o) const
+    {
+      o << '\n';
+    }
+    void link(Page_Buffer &o, const QString &name, const Options &opts) const
+    {
+      o << '[' << name << "](";
+      o.set_escaping(Page_Buffer::RAW);
+      o << page_name(name, opts);
+      o.set_escaping(Page_Buffer::MARKDOWN);
+      o << ')';
+    }
+  public:
+    const char *name() const
+    {
+      return "markdown";
+    }
+    QString page_name(const QString &name, const Options &opts) const
+    {
+      return name + ".md";
+    }
+};
+
+/** Standalone HTML pages, i.e. with the style sheet inlined */
+class Html_Renderer : public Doc_Renderer {
+  protected:
+    Page_Buffer::Escaping escaping() const
+    {
+      return Page_Buffer::HTML;
+    }
+    void begin(Page_Buffer &o, const QString &title,
+        const Options &opts) const
+    {
+      o << "<!DOCTYPE html>\n"
+        "<html>\n"
+        "<head>\n"
+        "<meta charset=\"utf-8\">\n"
+        "<meta name=\"generator\" content=\"" << doxy2man::name
+        << doxy2man::ver << "\">\n"
+        "<title>" << title << " - " << opts.pkg << "</title>\n"
+        "<style>\n"
+        "body { max-width: 50em; margin: auto; padding: 0 1em;"
+        " font-family: sans-serif; }\n"
+        "pre { background: #f4f4f4; padding: 0.5em; overflow-x: auto; }\n"
+        "footer { color: #666; border-top: 1px solid #ccc; }\n"
+        "</style>\n"
+        "</head>\n"
+        "<body>\n";
+    }
+    void end(Page_Buffer &o, const Options &opts) const
+    {
+      o << "<footer>" << opts.pkg << ", "
+        << opts.date.toString("yyyy-MM-dd") << "</footer>\n"
+        "</body>\n"
+        "</html>\n";
+    }
+    void heading(Page_Buffer &o, int level, const QString &text) const
+    {
+      char h[] = "h1";
+      h[1] = '0' + level;
+      o << '<' << h << '>' << text << "</" << h << ">\n";
+    }
+    void paragraphs(Page_Buffer &o, const QString &s) const
+    {
+      o.paragraphs(s, "<p>", "</p>\n");
+    }
+    void begin_code(Page_Buffer &o) const
+    {
+      o << "<pre><code>";
+    }
+    void end_code(Page_Buffer &o) const
+    {
+      o << "</code></pre>\n";
+    }
+    void code(Page_Buffer &o, const QString &name) const
+    {
+      o << "<code>" << name << "</code>";
+    }
+    void begin_list(Page_Buffer &o) const
+    {
+      o << "<ul>\n";
+    }
+    void item(Page_Buffer &o) const
+    {
+      o << "<li>";
+    }
+    void end_item(Page_Buffer &o) const
+    {
+      o << "</li>\n";
+    }
+    void end_list(Page_Buffer &o) const
+    {
+      o << "</ul>\n";
+    }
+    void link(Page_Buffer &o, const QString &name, const Options &opts) const
+    {
+      o << "<a href=\"" << page_name(name, opts) << "\">" << name << "</a>";
+    }
+  public:
+    const char *name() const
+    {
+      return "html";
+    }
+    QString page_name(const QString &name, const Options &opts) const
+    {
+      return name + ".html";
+    }
+};
+
+/** Page_Buffer with the punctuation of JSON, i.e. it inserts the commas */
+class Json : public Page_Buffer {
+  private:
+    bool first;
+
+    void comma()
+    {
+      if (!first)
+        *this << ',';
+      first = false;
+    }
+  public:
+    Json()
+      : Page_Buffer(JSON), first(true)
+    {
+    }
+    void key(const char *k)
+    {
+      comma();
+      *this << '"' << k << "\":";
+    }
+    void begin_object(const char *k = 0)
+    {
+      if (k)
+        key(k);
+      else
+        comma();
+      *this << '{';
+      first = true;
+    }
+    void end_object()
+    {
+      *this << '}';
+      first = false;
+    }
+    void begin_array(const char *k)
+    {
+      key(k);
+      *this << '[';
+      first = true;
+    }
+    void end_array()
+    {
+      *this << ']';
+      first = false;
+    }
+    void value(const QString &v)
+    {
+      comma();
+      *this << '"' << v << '"';
+    }
+    void member(const char *k, const QString &v)
+    {
+      key(k);
+      *this << '"' << v << '"';
+    }
+    void member(const char *k, Atom v)
+    {
+      key(k);
+      *this << '"' << v << '"';
+    }
+    /** Ends a record of JSON lines */
+    void end_line()
+    {
+      *this << '\n';
+      first = true;
+    }
+};
+
+/** One JSON object per line and header, struct and function, e.g. for
+ *  the tooltips of an IDE
+ *
+ * All records of a header are written into one file, the strings are
+ * the descriptions as on the man pages.
+ */
+class Json_Renderer : public Renderer {
+  private:
+    static void write_struct(Json &o, const Struct &s)
+    {
+      o.begin_object();
+      o.member("kind", "struct");
+      o.member("id", s.id);
+      o.member("name", s.name);
+      o.member("brief", s.brief_desc);
+      o.member("description", s.desc);
+      o.begin_array("members");
+      foreach (const Member &m, s.members) {
+        o.begin_object();
+        o.member("type", m.type);
+        o.member("name", m.name);
+        o.member("args", m.arg_string);
+        o.member("brief", m.brief_desc);
+        o.member("description", m.desc);
+        o.end_object();
+      }
+      o.end_array();
+      o.end_object();
+      o.end_line();
+    }
+    static void write_function(Json &o, const Function &f, const Header &h,
+        const Options &opts)
+    {
+      static const char *const dirs[] = { "", "in", "out" };
+      o.begin_object();
+      o.member("kind", "function");
+      o.member("name", f.name);
+      o.member("header", h.name);
+      o.member("type", f.type);
+      o.member("brief", f.brief_desc);
+      o.member("description", f.desc);
+      o.begin_array("parameters");
+      foreach (const Parameter &p, f.parameters) {
+        o.begin_object();
+        o.member("type", p.type);
+        o.member("name", p.name);
+        o.member("direction", dirs[p.dir]);
+        o.member("brief", p.brief_desc);
+        o.member("description", p.desc);
+        o.end_object();
+      }
+      o.end_array();
+      o.member("return", f.return_desc);
+      o.begin_array("return_values");
+      foreach (const Parameter &p, f.ret_values) {
+        o.begin_object();
+        o.member("name", p.name);
+        o.member("description", p.desc);
+        o.end_object();
+      }
+      o.end_array();
+      o.begin_array("structs");
+      if (opts.enable_structs)
+        foreach (const QString &ref_id, f.ref_ids)
+          o.value(ref_id);
+      o.end_array();
+      o.begin_array("see_also");
+      QVector<int> related;
+      see_also_functions(f, h, opts, related);
+      foreach (int k, related)
+        o.value(h.functions[k].name);
+      foreach (const See_Also &see, f.see_also)
+        o.value(atoms.str(see.name));
+      o.end_array();
+      o.begin_array("authors");
+      foreach (const QString &author, f.authors)
+        o.value(author);
+      o.end_array();
+      if (opts.enable_copyright)
+        o.member("copyright",
+            f.copyright.isEmpty() ? h.copyright : f.copyright);
+      o.end_object();
+      o.end_line();
+    }
+  public:
+    const char *name() const
+    {
+      return "json";
+    }
+    QString page_name(const QString &name, const Options &opts) const
+    {
+      return name + ".jsonl";
+    }
+    bool function_pages() const
+    {
+      return false;
+    }
+    QByteArray summary(const Header &h, const Options &opts) const
+    {
+      Json o;
+      o.begin_object();
+      o.member("kind", "header");
+      o.member("name", h.name);
+      o.member("brief", h.brief_desc);
+      o.member("description", h.desc);
+      if (opts.enable_copyright)
+        o.member("copyright", h.copyright);
+      o.end_object();
+      o.end_line();
+      if (opts.enable_structs) {
+        foreach (const Struct &s, h.structs)
+          write_struct(o, s);
+        foreach (const Struct *s, h.ref_structs)
+          write_struct(o, *s);
+      }
+      for (int k = 0; k < h.functions.size(); ++k)
+        write_function(o, h.sorted(k), h, opts);
+      return o.data();
+    }
+};
+
+Man_Renderer man_renderer;
+Markdown_Renderer markdown_renderer;
+Html_Renderer html_renderer;
+Json_Renderer json_renderer;
+
+const Renderer *find_renderer(const QString &name)
+{
+  static const Renderer *const renderers[] = {
+    &man_renderer, &markdown_renderer, &html_renderer, &json_renderer };
+  for (size_t i = 0; i < sizeof renderers / sizeof renderers[0]; ++i)
+    if (name == renderers[i]->name())
+      return renderers[i];
+  return 0;
+}
+
+template <typename F>
+class Index_Runner : public QRunnable {
+  private:
+    F &f;
+    int n;
+    QAtomicInt &next;
+    QMutex &mutex;
+    string &error;
+  public:
+    Index_Runner(F &f, int n, QAtomicInt &next, QMutex &mutex, string &error)
+      : f(f), n(n), next(next), mutex(mutex), error(error)
+    {
+    }
+    void run()
+    {
+      for (;;) {
+        int i = next.fetchAndAddOrdered(1);
+        if (i >= n)
+          return;
+        try {
+          f(i);
+        } catch (const exception &e) {
+          QMutexLocker locker(&mutex);
+          if (error.empty())
+            error = e.what();
+          next.fetchAndStoreOrdered(n);
+          return;
+        }
+      }
+    }
+};
+
+/** Calls f(0), ..., f(n-1) using up to jobs threads
+ *
+ * The indices are handed out one by one, thus expensive items don't
+ * stall the others. The first exception is rethrown (as runtime_error)
+ * in the calling thread after all threads are done.
+ */
+template <typename F>
+void parallel_for(int n, int jobs, F f)
+{
+  if (jobs < 2 || n < 2) {
+    for (int i = 0; i < n; ++i)
+      f(i);
+    return;
+  }
+  QThreadPool pool;
+  pool.setMaxThreadCount(jobs);
+  QAtomicInt next(0);
+  QMutex mutex;
+  string error;
+  for (int i = 0; i < std::min(jobs, n); ++i)
+    pool.start(new Index_Runner<F>(f, n, next, mutex, error));
+  pool.waitForDone();
+  if (!error.empty())
+    throw runtime_error(error);
+}
+
+/** Renders and writes the summary page of h in each format
+ *
+ * A format without function pages always gets it, since it is the only
+ * one.
+ */
+void write_summary_pages(const Header &h, const Options &opts,
+    Page_Writer &writer)
+{
+  writer.claim(h.name);
+  if (!opts.in_shard(h.name))
+    return;
+  foreach (const Renderer *r, opts.renderers) {
+    if (!opts.enable_summary_page && r->function_pages())
+      continue;
+    writer.write(h.name, r->page_name(h.name, opts), r->summary(h, opts));
+  }
+}
+
+/** Renders and writes the pages of one function in each format
+ *
+ * Reads Header and Options only, thus it may be called from several
+ * threads.
+ */
+void write_function_page(const Function &f, const Header &h,
+    const Options &opts, Page_Writer &writer)
+{
+  if (!opts.in_shard(f.name))
+    return;
+  foreach (const Renderer *r, opts.renderers) {
+    if (!r->function_pages())
+      continue;
+    writer.write(h.name, r->page_name(f.name, opts),
+        r->function(f, h, opts));
+  }
+}
+
+class Function_Page_Writer {
+  private:
+    const Header &h;
+    const Options &opts;
+    Page_Writer &writer;
+  public:
+    Function_Page_Writer(const Header &h, const Options &opts,
+        Page_Writer &writer)
+      : h(h), opts(opts), writer(writer)
+    {
+    }
+    void operator()(int i) const
+    {
+      write_function_page(h.functions[i], h, opts, writer);
+    }
+};
+
+/** Owner of the struct pages in the manifest
+ *
+ * Not h, since other headers may include them as well. A run that
+ * claims it removes the struct pages that no function refers to anymore.
+ */
+const char struct_owner[] = "-structs";
+
+/** Writes the structs the functions of h refer to, unless already written
+ *  in this pass, see --struct-so
+ */
+void write_struct_pages(const Header &h, const Options &opts,
+    Page_Writer &writer)
+{
+  if (!opts.enable_structs)
+    return;
+  foreach (const Renderer *r, opts.renderers) {
+    if (!r->struct_pages(opts))
+      continue;
+    foreach (const Function &f, h.functions) {
+      foreach (const QString &ref_id, f.ref_ids) {
+        const Struct *s;
+        try {
+          s = &h.struct_by_id(ref_id);
+        } catch (const range_error &) {
+          continue; // the function page warns about it
+        }
+        if (!opts.in_shard("struct_" + s->name))
+          continue;
+        QString name(r->page_name("struct_" + s->name, opts));
+        if (writer.contains(name))
+          continue;
+        writer.write(struct_owner, name, r->structure(*s, opts));
+      }
+    }
+  }
+}
+
+void print_man(const Header &h, const Options &opts, Page_Writer &writer)
+{
+  write_summary_pages(h, opts, writer);
+  write_struct_pages(h, opts, writer);
+
+  parallel_for(h.functions.size(), opts.jobs,
+      Function_Page_Writer(h, opts, writer));
+}
+
+enum Tag {
+  TAG_IGNORE,
+  TAG_SECTIONDEF_ENUM,
+  TAG_SECTIONDEF_TYPEDEF,
+  TAG_SECTIONDEF_FUNC,
+  TAG_SECTIONDEF_DEFINE,
+  TAG_MEMBERDEF_ENUM,
+  TAG_MEMBERDEF_TYPDEF,
+  TAG_MEMBERDEF_FUNC,
+  TAG_MEMBERDEF_DEFINE,
+  TAG_MEMBERDEF_VAR,
+  TAG_NAME,
+  TAG_ENUMVALUE,
+  TAG_BRIEFDESC,
+  TAG_DETAILDESC,
+  TAG_TYPE,
+  TAG_DEFINITION,
+  TAG_ARGSTRING,
+  TAG_PARAM,
+  TAG_DECLNAME,
+  TAG_COMPOUNDNAME,
+  TAG_LINEBREAK,
+  TAG_SIMPLESECT_AUTHOR,
+  TAG_SIMPLESECT_RETURN,
+  TAG_SIMPLESECT_COPYRIGHT,
+  TAG_SIMPLESECT_SEE,
+  TAG_PARAMETERLIST, // kind == param
+  TAG_RETVALLIST, // fake parameterlist && kind == param
+  TAG_PARAMETERNAME,
+  TAG_PARAMETERDESC,
+  TAG_PARAMETERITEM,
+  TAG_REF, // refid xml file
+  TAG_REF_MEMBER, // inline function ref (in briefdesc)
+  TAG_COMPOUNDDEF_FILE,
+  TAG_COMPOUNDDEF_STRUCT,
+  TAG_ULINK, // mailto link ...
+  TAG_PARA, // paragraph
+  TAG_COUNT
+};
+
+struct Kind_Tag {
+  const char *value;
+  Tag tag;
+};
+
+/** How an element name (and possibly one of its attributes) maps to a Tag
+ */
+struct Element {
+  const char *name;
+  Tag tag; // default
+  const char *attr; // if set, its value selects the tag from kinds
+  const Kind_Tag *kinds; // terminated by a 0 value
+};
+
+const Kind_Tag sectiondef_kinds[] = {
+  { "func", TAG_SECTIONDEF_FUNC }, { 0, TAG_IGNORE } };
+const Kind_Tag memberdef_kinds[] = {
+  { "function", TAG_MEMBERDEF_FUNC }, { "variable", TAG_MEMBERDEF_VAR },
+  { 0, TAG_IGNORE } };
+const Kind_Tag parameterlist_kinds[] = {
+  { "param", TAG_PARAMETERLIST }, { "retval", TAG_RETVALLIST },
+  { 0, TAG_IGNORE } };
+const Kind_Tag simplesect_kinds[] = {
+  { "author", TAG_SIMPLESECT_AUTHOR }, { "return", TAG_SIMPLESECT_RETURN },
+  { "copyright", TAG_SIMPLESECT_COPYRIGHT }, { "see", TAG_SIMPLESECT_SEE },
+  { 0, TAG_IGNORE } };
+const Kind_Tag compounddef_kinds[] = {
+  { "file", TAG_COMPOUNDDEF_FILE }, { "struct", TAG_COMPOUNDDEF_STRUCT },
+  { 0, TAG_IGNORE } };
+const Kind_Tag ref_kinds[] = {
+  { "member", TAG_REF_MEMBER }, { 0, TAG_IGNORE } };
+
+const Element elements[] = {
+  { "sectiondef",           TAG_IGNORE,          "kind",    sectiondef_kinds },
+  { "memberdef",            TAG_IGNORE,          "kind",    memberdef_kinds },
+  { "type",                 TAG_TYPE,            0,         0 },
+  { "definition",           TAG_DEFINITION,      0,         0 },
+  { "name",                 TAG_NAME,            0,         0 },
+  { "param",                TAG_PARAM,           0,         0 },
+  { "declname",             TAG_DECLNAME,        0,         0 },
+  { "briefdescription",     TAG_BRIEFDESC,       0,         0 },
+  { "para",                 TAG_PARA,            0,         0 },
+  { "detaileddescription",  TAG_DETAILDESC,      0,         0 },
+  { "parameterlist",        TAG_IGNORE,          "kind",    parameterlist_kinds },
+  { "parametername",        TAG_PARAMETERNAME,   0,         0 },
+  { "parameterdescription", TAG_PARAMETERDESC,   0,         0 },
+  { "simplesect",           TAG_IGNORE,          "kind",    simplesect_kinds },
+  { "parameteritem",        TAG_PARAMETERITEM,   0,         0 },
+  { "compounddef",          TAG_IGNORE,          "kind",    compounddef_kinds },
+  { "compoundname",         TAG_COMPOUNDNAME,    0,         0 },
+  { "ulink",                TAG_ULINK,           0,         0 },
+  { "ref",                  TAG_REF,             "kindref", ref_kinds },
+  { "argsstring",           TAG_ARGSTRING,       0,         0 }
+};
+
+/** Perfect hash table of the element names we care about
+ *
+ * The hash function is collision free for the names in elements, which
+ * is checked when the table is built. Thus, a lookup costs one hash
+ * computation and one string compare.
+ */
+class Element_Map {
+  private:
+    enum { SIZE = 64 };
+    const Element *table[SIZE];
+
+    template <typename S>
+    static unsigned hash(const S &s)
+    {
+      return (2 * s.size() + s.at(1).unicode() + s.at(s.size()-1).unicode())
+        & (SIZE-1);
+    }
+  public:
+    Element_Map()
+    {
+      std::fill(table, table + SIZE, (const Element*)0);
+      for (size_t i = 0; i < sizeof elements / sizeof elements[0]; ++i) {
+        unsigned h = hash(QString(elements[i].name));
+        if (table[h])
+          throw logic_error("element hash collision - adjust Element_Map::hash");
+        table[h] = elements + i;
+      }
+    }
+    template <typename S>
+    const Element *lookup(const S &name) const
+    {
+      if (name.size() < 3)
+        return 0;
+      const Element *e = table[hash(name)];
+      if (e && name == QLatin1String(e->name))
+        return e;
+      return 0;
+    }
+};
+
+const Element_Map element_map;
+
+template <typename S>
+Tag select_kind(const S &value, const Element *e)
+{
+  for (const Kind_Tag *k = e->kinds; k->value; ++k)
+    if (value == QLatin1String(k->value))
+      return k->tag;
+  return e->tag;
+}
+
+/** Selects the Tag of an element
+ *
+ * Works with QXmlAttributes and QXmlStreamAttributes.
+ */
+template <typename S, typename Attributes>
+Tag tag_of(const S &name, const Attributes &atts)
+{
+  const Element *e = element_map.lookup(name);
+  if (!e)
+    return TAG_IGNORE;
+  if (!e->attr)
+    return e->tag;
+  return select_kind(atts.value(QLatin1String(e->attr)), e);
+}
+
+/** The role of an element, given its position in the document
+ *
+ * E.g. a para is the brief description of a function if its parent is
+ * a briefdescription whose parent is a function memberdef.
+ */
+enum State {
+  S_NONE,
+
+  S_FILE,
+  S_FILE_NAME,
+  S_FILE_BRIEF,
+  S_FILE_BRIEF_PARA,
+  S_FILE_DETAIL,
+  S_FILE_DETAIL_PARA,
+  S_FILE_COPYRIGHT,
+  S_FILE_COPYRIGHT_PARA,
+
+  S_STRUCT,
+  S_STRUCT_NAME,
+  S_STRUCT_BRIEF,
+  S_STRUCT_BRIEF_PARA,
+  S_STRUCT_DETAIL,
+  S_STRUCT_DETAIL_PARA,
+  S_STRUCT_SECTION,
+
+  S_FUNC,
+  S_FUNC_TYPE,
+  S_FUNC_NAME,
+  S_FUNC_BRIEF,
+  S_FUNC_BRIEF_PARA,
+  S_FUNC_DETAIL,
+  S_FUNC_DETAIL_PARA,
+  S_FUNC_SEE_REF,
+  S_FUNC_AUTHOR,
+  S_FUNC_AUTHOR_PARA,
+  S_FUNC_COPYRIGHT,
+  S_FUNC_COPYRIGHT_PARA,
+  S_FUNC_SEE,
+  S_FUNC_SEE_PARA,
+
+  S_PARAM,
+  S_PARAM_TYPE,
+  S_PARAM_TYPE_REF,
+  S_PARAM_BRIEF,
+  S_PARAM_BRIEF_PARA,
+  S_DECLNAME,
+
+  S_VAR,
+  S_STRUCT_VAR, // member of a struct
+  S_VAR_TYPE,
+  S_VAR_NAME,
+  S_VAR_ARGSTRING,
+  S_VAR_BRIEF,
+  S_VAR_BRIEF_PARA,
+  S_VAR_DETAIL,
+  S_VAR_DETAIL_PARA,
+
+  S_PARAMETERLIST,
+  S_RETVALLIST,
+  S_PARAMETER_ITEM,
+  S_RETVAL_ITEM,
+  S_PARAMETERNAME,
+  S_PARAMETERDESC,
+  S_PARAMETERDESC_PARA,
+  S_RETURN,
+  S_RETURN_PARA,
+
+  S_ULINK,
+
+  S_COUNT
+};
+
+/** State transition table: state of an element = f(state of parent, tag)
+ */
+class Transitions {
+  private:
+    State table[S_COUNT][TAG_COUNT];
+
+    void set(State parent, Tag t, State s)
+    {
+      table[parent][t] = s;
+    }
+    void set_var(State parent)
+    {
+      set(parent, TAG_TYPE, S_VAR_TYPE);
+      set(parent, TAG_NAME, S_VAR_NAME);
+      set(parent, TAG_ARGSTRING, S_VAR_ARGSTRING);
+      set(parent, TAG_BRIEFDESC, S_VAR_BRIEF);
+      set(parent, TAG_DETAILDESC, S_VAR_DETAIL);
+    }
+  public:
+    Transitions()
+    {
+      // these elements are handled regardless of their context
+      State context_free[TAG_COUNT];
+      std::fill(context_free, context_free + TAG_COUNT, S_NONE);
+      context_free[TAG_COMPOUNDDEF_FILE] = S_FILE;
+      context_free[TAG_COMPOUNDDEF_STRUCT] = S_STRUCT;
+      context_free[TAG_MEMBERDEF_FUNC] = S_FUNC;
+      context_free[TAG_MEMBERDEF_VAR] = S_VAR;
+      context_free[TAG_PARAM] = S_PARAM;
+      context_free[TAG_DECLNAME] = S_DECLNAME;
+      context_free[TAG_PARAMETERLIST] = S_PARAMETERLIST;
+      context_free[TAG_RETVALLIST] = S_RETVALLIST;
+      context_free[TAG_PARAMETERNAME] = S_PARAMETERNAME;
+      context_free[TAG_PARAMETERDESC] = S_PARAMETERDESC;
+      context_free[TAG_SIMPLESECT_RETURN] = S_RETURN;
+      context_free[TAG_ULINK] = S_ULINK;
+      for (int i = 0; i < S_COUNT; ++i)
+        std::copy(context_free, context_free + TAG_COUNT, table[i]);
+
+      set(S_FILE, TAG_COMPOUNDNAME, S_FILE_NAME);
+      set(S_FILE, TAG_BRIEFDESC, S_FILE_BRIEF);
+      set(S_FILE_BRIEF, TAG_PARA, S_FILE_BRIEF_PARA);
+      set(S_FILE, TAG_DETAILDESC, S_FILE_DETAIL);
+      set(S_FILE_DETAIL, TAG_PARA, S_FILE_DETAIL_PARA);
+      set(S_FILE_DETAIL_PARA, TAG_SIMPLESECT_COPYRIGHT, S_FILE_COPYRIGHT);
+      set(S_FILE_COPYRIGHT, TAG_PARA, S_FILE_COPYRIGHT_PARA);
+
+      for (int t = 0; t < TAG_COUNT; ++t)
+        if (context_free[t] == S_NONE)
+          set(S_STRUCT, Tag(t), S_STRUCT_SECTION);
+      set(S_STRUCT, TAG_COMPOUNDNAME, S_STRUCT_NAME);
+      set(S_STRUCT, TAG_BRIEFDESC, S_STRUCT_BRIEF);
+      set(S_STRUCT_BRIEF, TAG_PARA, S_STRUCT_BRIEF_PARA);
+      set(S_STRUCT, TAG_DETAILDESC, S_STRUCT_DETAIL);
+      set(S_STRUCT_DETAIL, TAG_PARA, S_STRUCT_DETAIL_PARA);
+      set(S_STRUCT_SECTION, TAG_MEMBERDEF_VAR, S_STRUCT_VAR);
+
+      set(S_FUNC, TAG_TYPE, S_FUNC_TYPE);
+      set(S_FUNC, TAG_NAME, S_FUNC_NAME);
+      set(S_FUNC, TAG_BRIEFDESC, S_FUNC_BRIEF);
+      set(S_FUNC_BRIEF, TAG_PARA, S_FUNC_BRIEF_PARA);
+      set(S_FUNC, TAG_DETAILDESC, S_FUNC_DETAIL);
+      set(S_FUNC_DETAIL, TAG_PARA, S_FUNC_DETAIL_PARA);
+      set(S_FUNC_DETAIL_PARA, TAG_REF_MEMBER, S_FUNC_SEE_REF);
+      set(S_FUNC_DETAIL_PARA, TAG_SIMPLESECT_AUTHOR, S_FUNC_AUTHOR);
+      set(S_FUNC_AUTHOR, TAG_PARA, S_FUNC_AUTHOR_PARA);
+      set(S_FUNC_DETAIL_PARA, TAG_SIMPLESECT_COPYRIGHT, S_FUNC_COPYRIGHT);
+      set(S_FUNC_COPYRIGHT, TAG_PARA, S_FUNC_COPYRIGHT_PARA);
+      set(S_FUNC_DETAIL_PARA, TAG_SIMPLESECT_SEE, S_FUNC_SEE);
+      set(S_FUNC_SEE, TAG_PARA, S_FUNC_SEE_PARA);
+
+      set(S_PARAM, TAG_TYPE, S_PARAM_TYPE);
+      set(S_PARAM_TYPE, TAG_REF, S_PARAM_TYPE_REF);
+      set(S_PARAM, TAG_BRIEFDESC, S_PARAM_BRIEF);
+      set(S_PARAM_BRIEF, TAG_PARA, S_PARAM_BRIEF_PARA);
+
+      set_var(S_VAR);
+      set_var(S_STRUCT_VAR);
+      set(S_VAR_BRIEF, TAG_PARA, S_VAR_BRIEF_PARA);
+      set(S_VAR_DETAIL, TAG_PARA, S_VAR_DETAIL_PARA);
+
+      set(S_PARAMETERLIST, TAG_PARAMETERITEM, S_PARAMETER_ITEM);
+      set(S_RETVALLIST, TAG_PARAMETERITEM, S_RETVAL_ITEM);
+      set(S_PARAMETERDESC, TAG_PARA, S_PARAMETERDESC_PARA);
+      set(S_RETURN, TAG_PARA, S_RETURN_PARA);
+    }
+    State next(State parent, Tag t) const
+    {
+      return table[parent][t];
+    }
+};
+
+const Transitions transitions;
+
+/** Receives each function as soon as its memberdef is closed
+ */
+class Function_Sink {
+  public:
+    virtual ~Function_Sink() {}
+    virtual void add(Function &f) = 0;
+};
+
+class Handler : public QXmlDefaultHandler
+{
+  public:
+    Header &h;
+  private:
+    Tag tag;
+    Function_Sink *sink;
+  public:
+    /** Without a sink, functions are collected in header.functions */
+    Handler(Header &header, Function_Sink *sink = 0)
+      : h(header), tag(TAG_IGNORE), sink(sink)
+    {
+    }
+  private:
+    Function f;
+    Parameter p;
     Parameter_Item pi;
     Struct st;
     Member member;
+    // parameter name -> index in f.parameters
+    QHash<QString, int> parameter_index;
   QString buffer;
-  QStack<Tag> tag_stack;
+  struct Frame {
+    Tag tag;
+    State state;
+  };
+  QStack<Frame> stack;
+
+  QString url;
+  QString url_text;
+
+  static QString str(const QString &s) { return s; }
+  static QString str(const QStringRef &s) { return s.toString(); }
+
+  bool startElement ( const QString & namespaceURI, const QString & localName, const QString & qName, const QXmlAttributes & atts )
+  {
+    start(qName, atts);
+    return true;
+  }
+
+  bool  characters ( const QString & ch )
+  {
+    text(ch);
+    return true;
+  }
+
+  bool  endElement ( const QString & namespaceURI, const QString & localName, const QString & qName )
+  {
+    end();
+    return true;
+  }
+
+  public:
+  /** Callbacks used by the SAX interface and the pull parser
+   *
+   * Names, attributes and text are only copied where they are stored.
+   */
+  template <typename S, typename Attributes>
+  void start(const S &name, const Attributes &atts)
+  {
+    //cout << name.toUtf8().data() << '\n';
+    tag = tag_of(name, atts);
+    if (tag != TAG_IGNORE && tag != TAG_ULINK && tag != TAG_REF && tag != TAG_REF_MEMBER)
+      buffer.clear();
+    Frame frame;
+    frame.tag = tag;
+    frame.state = transitions.next(stack.empty() ? S_NONE : stack.top().state,
+        tag);
+    stack.push(frame);
+
+    switch (frame.state) {
+      case S_FUNC:
+        f = Function();
+        parameter_index.clear();
+        break;
+      case S_PARAM:
+        p = Parameter();
+        break;
+      case S_PARAM_TYPE_REF:
+        if (atts.value(QLatin1String("kindref")) == QLatin1String("compound")) {
+          p.compound_ref = str(atts.value(QLatin1String("refid")));
+          f.ref_ids.push_back(p.compound_ref);
+          h.ref_ids.insert(p.compound_ref);
+        }
+        break;
+      case S_FUNC_SEE_REF:
+        f.see_also.push_back(See_Also(str(atts.value(QLatin1String("refid")))));
+        break;
+      case S_PARAMETERNAME:
+        pi = Parameter_Item();
+        pi.dir = DIR_NONE;
+        if (atts.value(QLatin1String("direction")) == QLatin1String("in"))
+          pi.dir = DIR_IN;
+        else if (atts.value(QLatin1String("direction")) == QLatin1String("out"))
+          pi.dir = DIR_OUT;
+        break;
+      case S_ULINK:
+        url = str(atts.value(QLatin1String("url")));
+        break;
+      case S_VAR:
+      case S_STRUCT_VAR:
+        member = Member();
+        break;
+      case S_STRUCT:
+        st = Struct();
+        st.id = str(atts.value(QLatin1String("id")));
+        break;
+    }
+  }
+
+  template <typename S>
+  void text(const S &ch)
+  {
+    if (tag == TAG_ULINK) {
+      url_text.append(ch);
+      return;
+    }
+    buffer.append(ch);
+  }
+
+  void end()
+  {
+    //cout << buffer.toUtf8().data() << '\n';
+
+    switch (stack.top().state) {
+      case S_FUNC_TYPE:
+        f.type = atoms.intern(buffer);
+        break;
+      case S_PARAM_TYPE:
+        p.type = atoms.intern(buffer);
+        break;
+      case S_VAR_TYPE:
+        member.type = atoms.intern(buffer);
+        break;
+      case S_FUNC_NAME:
+        f.name = buffer;
+        break;
+      case S_VAR_NAME:
+        member.name = buffer;
+        break;
+      case S_VAR_ARGSTRING:
+        member.arg_string = buffer;
+        break;
+      case S_FUNC:
+        if (sink)
+          sink->add(f);
+        else
+          append_swap(h.functions, f);
+        break;
+      case S_FUNC_BRIEF_PARA:
+        f.brief_desc = buffer;
+        break;
+      case S_PARAM_BRIEF_PARA:
+        p.brief_desc = buffer;
+        break;
+      case S_FILE_BRIEF_PARA:
+        h.brief_desc = buffer;
+        break;
+      case S_VAR_BRIEF_PARA:
+        member.brief_desc = buffer;
+        break;
+      case S_STRUCT_BRIEF_PARA:
+        st.brief_desc = buffer;
+        break;
+      case S_FUNC_DETAIL_PARA:
+        f.desc += buffer;
+        f.desc += '\n';
+        break;
+      case S_FILE_DETAIL_PARA:
+        h.desc += buffer;
+        h.desc += '\n';
+        break;
+      case S_VAR_DETAIL_PARA:
+        member.desc += buffer;
+        member.desc += '\n';
+        break;
+      case S_STRUCT_DETAIL_PARA:
+        st.desc += buffer;
+        st.desc += '\n';
+        break;
+      case S_FUNC_AUTHOR_PARA:
+        f.authors.push_back(buffer.trimmed());
+        buffer.clear();
+        break;
+      case S_PARAMETERDESC_PARA:
+        pi.desc += buffer;
+        pi.desc += '\n';
+        buffer.clear();
+        break;
+      case S_RETURN_PARA:
+        f.return_desc = buffer;
+        buffer.clear();
+        break;
+      case S_FILE_COPYRIGHT_PARA:
+        h.copyright = buffer;
+        buffer.clear();
+        break;
+      case S_FUNC_COPYRIGHT_PARA:
+        f.copyright = buffer;
+        buffer.clear();
+        break;
+      case S_FUNC_SEE_PARA:
+        f.see_also.push_back(See_Also());
+        f.see_also.last().set_name(buffer);
+        buffer.clear();
+        break;
+      case S_DECLNAME:
+        p.name = buffer;
+        break;
+      case S_PARAM:
+        if (!parameter_index.contains(p.name))
+          parameter_index.insert(p.name, f.parameters.size());
+        append_swap(f.parameters, p);
+        break;
+      case S_PARAMETERNAME:
+        pi.name = buffer;
+        break;
+      case S_PARAMETER_ITEM:
+        {
+          int i = parameter_index.value(pi.name, -1);
+          if (i == -1) {
+            qWarning() << "Can't find param name: " << pi.name;
+          } else {
+            f.parameters[i] = pi;
+          }
+        }
+        break;
+      case S_RETVAL_ITEM:
+        {
+          Parameter a;
+          a = pi;
+          a.name = pi.name;
+          append_swap(f.ret_values, a);
+        }
+        break;
+      case S_STRUCT_NAME:
+        st.name = buffer;
+        break;
+      case S_FILE_NAME:
+        h.name = buffer;
+        h.module_name = h.name; // h.name.remove(".h").toUpper();
+        break;
+      case S_ULINK:
+        if (!url.isEmpty()) {
+          if (url.startsWith("mailto:")) {
+            buffer += "<";
+            buffer += url.mid(7);
+            buffer += ">";
+          } else
+            buffer += url;
+        }
+        url.clear();
+        url_text.clear();
+        break;
+      case S_STRUCT:
+        h.ref_id_struct_map[st.id] = h.structs.size();
+        append_swap(h.structs, st);
+        break;
+      case S_STRUCT_VAR:
+        append_swap(st.members, member);
+        break;
+      case S_FUNC_SEE_REF:
+        f.see_also.last().set_name_last(buffer);
+        break;
+    }
+
+    stack.pop();
+    if (!stack.empty())
+      tag = stack.top().tag;
+  }
+};
+
+/** Input files read in this run, for --depfile
+ *
+ * This includes the referenced files that are only found while parsing
+ * and compound.xsd.
+ */
+class Dependencies {
+  private:
+    QSet<QString> inputs;
+    QMutex mutex;
+
+    static QByteArray escape(const QString &filename)
+    {
+      QByteArray r;
+      QByteArray s(QFile::encodeName(filename));
+      for (int i = 0; i < s.size(); ++i) {
+        switch (s[i]) {
+          case ' ':
+          case '#':
+            r += '\\';
+            break;
+          case '$':
+            r += '$';
+            break;
+        }
+        r += s[i];
+      }
+      return r;
+    }
+  public:
+    void add(const QString &filename)
+    {
+      QMutexLocker locker(&mutex);
+      inputs.insert(filename);
+    }
+    /** Writes a Makefile rule: all outputs depend on all inputs */
+    void write(const QString &filename, const QStringList &outputs)
+    {
+      QStringList l(inputs.toList());
+      l.sort();
+      QByteArray data;
+      foreach (const QString &output, outputs) {
+        if (!data.isEmpty())
+          data += " \\\n";
+        data += escape(output);
+      }
+      data += ':';
+      foreach (const QString &input, l) {
+        data += " \\\n  ";
+        data += escape(input);
+      }
+      data += '\n';
+      write_atomically(filename, data);
+    }
+};
+
+QByteArray read_file(const QString &filename)
+{
+  QFile file(filename);
+  if (!file.open(QIODevice::ReadOnly)) {
+    QString msg("Could not open ");
+    msg += filename;
+    msg += " (";
+    msg += file.errorString();
+    msg += ")";
+    throw runtime_error(msg.toUtf8().data());
+  }
+  return file.readAll();
+}
+
+/** Validates XML input against compound.xsd
+ *
+ * Loading compound.xsd is expensive, thus it is only done once per
+ * directory, thread and run. With a cache directory, the hashes of
+ * successfully validated inputs are remembered between runs, such that
+ * unchanged files aren't validated again. Only the newest hash of each
+ * input that still exists is kept.
+ *
+ * check() may be called from several threads, QXmlSchema isn't
+ * thread-safe, though, thus each thread loads its own.
+ */
+class Validator {
+  private:
+    struct Schema {
+      QXmlSchema schema;
+      QByteArray hash;
+    };
+    typedef QMap<QString, Schema> Schemas;
+    QThreadStorage<Schemas*> schemas;
+
+    bool enabled;
+    Dependencies &deps;
+    QString cache_filename;
+    bool read_only; // i.e. --dry-run
+    QSet<QByteArray> validated;
+    QMap<QString, QByteArray> latest; // by absolute input path
+    bool changed; // i.e. latest has to be saved
+    QMutex mutex; // validated, latest and changed
+
+    void remember(const QString &filename, const QByteArray &hash)
+    {
+      QString path(QFileInfo(filename).absoluteFilePath());
+      QMutexLocker locker(&mutex);
+      validated.insert(hash);
+      if (latest.value(path) == hash)
+        return;
+      latest[path] = hash;
+      changed = true;
+    }
+
+    const Schema &schema(const QString &base_path)
+    {
+      if (!schemas.hasLocalData())
+        schemas.setLocalData(new Schemas);
+      Schemas &m = *schemas.localData();
+      QString xsd_filename(base_path + "/compound.xsd");
+      if (m.contains(xsd_filename))
+        return m[xsd_filename];
+
+      QFile xsd_file(xsd_filename);
+      if (!xsd_file.exists()) {
+        QString msg("XSD ");
+        msg += xsd_filename;
+        msg += " does not exist";
+        throw runtime_error(msg.toUtf8().data());
+      }
+
+      QByteArray data(read_file(xsd_filename));
+      deps.add(xsd_filename);
+      Schema s;
+      s.schema.load(data, QUrl::fromLocalFile(xsd_filename));
+      if (!s.schema.isValid()) {
+        QString msg("XSD ");
+        msg += xsd_filename;
+        msg += " is invalid";
+        throw runtime_error(msg.toUtf8().data());
+      }
+      s.hash = QCryptographicHash::hash(data, QCryptographicHash::Sha1);
+      m[xsd_filename] = s;
+      return m[xsd_filename];
+    }
+  public:
+    Validator(const Options &o, Dependencies &deps)
+      : enabled(o.enable_validate), deps(deps), read_only(o.dry_run),
+      changed(false)
+    {
+      if (o.cache_dir_path.isEmpty())
+        return;
+      cache_filename = o.cache_dir_path + "/validated";
+      QFile file(cache_filename);
+      if (!file.open(QIODevice::ReadOnly))
+        return;
+      while (!file.atEnd()) {
+        // hash and absolute path, older versions wrote just the hash
+        QByteArray line(file.readLine().trimmed());
+        int i = line.indexOf(' ');
+        if (i < 0)
+          continue;
+        QByteArray hash(QByteArray::fromHex(line.left(i)));
+        validated.insert(hash);
+        latest[QString::fromUtf8(line.mid(i + 1))] = hash;
+      }
+    }
+
+    /** As validate(), but without the phase timer, i.e. for the
+     *  worker threads */
+    void check(const QByteArray &data, const QString &filename,
+        const QString &base_path)
+    {
+      if (!enabled)
+        return;
+      const Schema &s = schema(base_path);
+      // a different compound.xsd must invalidate the cached results
+      QCryptographicHash h(QCryptographicHash::Sha1);
+      h.addData(s.hash);
+      h.addData(data);
+      QByteArray hash(h.result());
+      bool known;
+      {
+        QMutexLocker locker(&mutex);
+        known = validated.contains(hash);
+      }
+      if (known) {
+        remember(filename, hash);
+        return;
+      }
+
+      QXmlSchemaValidator validator(s.schema);
+      if (!validator.validate(data, QUrl::fromLocalFile(filename))) {
+        QString msg("XML input ");
+        msg += filename;
+        msg += " is invalid";
+        throw runtime_error(msg.toUtf8().data());
+      }
+      remember(filename, hash);
+    }
+    void validate(const QByteArray &data, const QString &filename,
+        const QString &base_path)
+    {
+      if (!enabled)
+        return;
+      Phase_Timer timer(Stats::VALIDATE);
+      check(data, filename, base_path);
+    }
+
+    /** Rewrites the cache file, if anything changed */
+    void save()
+    {
+      if (cache_filename.isEmpty() || !changed || read_only)
+        return;
+      QDir dir;
+      if (!dir.mkpath(QFileInfo(cache_filename).path())) {
+        QString m("Could not create cache dir: ");
+        m += QFileInfo(cache_filename).path();
+        throw runtime_error(m.toUtf8().data());
+      }
+      QByteArray data;
+      for (QMap<QString, QByteArray>::const_iterator i = latest.constBegin();
+          i != latest.constEnd(); ++i) {
+        if (!QFile::exists(i.key()))
+          continue;
+        data += i.value().toHex();
+        data += ' ';
+        data += i.key().toUtf8();
+        data += '\n';
+      }
+      write_atomically(cache_filename, data);
+      changed = false;
+    }
+};
+
+/** Read-only memory mapping of an XML input
+ *
+ * data() doesn't copy the mapped bytes, thus it must not outlive the
+ * Input_File. If mapping fails the file is read instead.
+ */
+class Input_File {
+  private:
+    QFile file;
+    uchar *addr;
+    QByteArray bytes;
+
+    Input_File(const Input_File &);
+    Input_File &operator=(const Input_File &);
+  public:
+    Input_File(const QString &filename)
+      : file(filename), addr(0)
+    {
+      if (!file.open(QIODevice::ReadOnly)) {
+        QString msg("Could not open ");
+        msg += filename;
+        msg += " (";
+        msg += file.errorString();
+        msg += ")";
+        throw runtime_error(msg.toUtf8().data());
+      }
+      if (file.size() > 0)
+        addr = file.map(0, file.size());
+      if (addr)
+        bytes = QByteArray::fromRawData(reinterpret_cast<const char*>(addr),
+            file.size());
+      else
+        bytes = file.readAll();
+    }
+    ~Input_File()
+    {
+      bytes.clear();
+      if (addr)
+        file.unmap(addr);
+    }
+    const QByteArray &data() const
+    {
+      return bytes;
+    }
+    QString filename() const
+    {
+      return file.fileName();
+    }
+};
+
+QDataStream &operator<<(QDataStream &s, Atom a)
+{
+  return s << atoms.str(a);
+}
+QDataStream &operator>>(QDataStream &s, Atom &a)
+{
+  QString x;
+  s >> x;
+  a = atoms.intern(x);
+  return s;
+}
+QDataStream &operator<<(QDataStream &s, const Parameter &p)
+{
+  return s << p.type << p.name << p.compound_ref << p.brief_desc << p.desc
+    << qint32(p.dir);
+}
+QDataStream &operator>>(QDataStream &s, Parameter &p)
+{
+  qint32 dir;
+  s >> p.type >> p.name >> p.compound_ref >> p.brief_desc >> p.desc >> dir;
+  p.dir = Direction(dir);
+  return s;
+}
+QDataStream &operator<<(QDataStream &s, const See_Also &x)
+{
+  return s << x.ref_id << x.name;
+}
+QDataStream &operator>>(QDataStream &s, See_Also &x)
+{
+  return s >> x.ref_id >> x.name;
+}
+QDataStream &operator<<(QDataStream &s, const Function &f)
+{
+  return s << f.name << f.parameters << f.type << f.authors << f.ret_values
+    << f.brief_desc << f.desc << f.return_desc << f.copyright << f.ref_ids
+    << f.see_also;
+}
+QDataStream &operator>>(QDataStream &s, Function &f)
+{
+  return s >> f.name >> f.parameters >> f.type >> f.authors >> f.ret_values
+    >> f.brief_desc >> f.desc >> f.return_desc >> f.copyright >> f.ref_ids
+    >> f.see_also;
+}
+QDataStream &operator<<(QDataStream &s, const Member &m)
+{
+  return s << m.name << m.type << m.desc << m.brief_desc << m.arg_string;
+}
+QDataStream &operator>>(QDataStream &s, Member &m)
+{
+  return s >> m.name >> m.type >> m.desc >> m.brief_desc >> m.arg_string;
+}
+QDataStream &operator<<(QDataStream &s, const Struct &x)
+{
+  return s << x.id << x.name << x.desc << x.brief_desc << x.members;
+}
+QDataStream &operator>>(QDataStream &s, Struct &x)
+{
+  return s >> x.id >> x.name >> x.desc >> x.brief_desc >> x.members;
+}
+
+/** Parsed models of earlier runs, one file per XML input
+ *
+ * The files are named after the SHA-1 of the input's absolute path and
+ * contain the SHA-1 of its content, thus a changed input misses the
+ * cache and its new model replaces the old one. Only what the handler
+ * produces is stored, i.e. nothing that depends on the options. Loading
+ * maps the file and decodes it with QDataStream, which is much cheaper
+ * than parsing the XML.
+ *
+ * load() and store() may be called from several threads.
+ */
+class Model_Cache {
+  private:
+    QString dir_path; // empty if disabled
+    bool read_only; // i.e. --dry-run
+    QSet<QString> used; // file names, for prune()
+    QMutex mutex;
+    enum { MAGIC = 0x6478326d, VERSION = 2 };
+
+    Model_Cache(const Model_Cache &);
+    Model_Cache &operator=(const Model_Cache &);
+
+    QString filename(const Input_File &input)
+    {
+      QString name(QCryptographicHash::hash(
+            QFileInfo(input.filename()).absoluteFilePath().toUtf8(),
+            QCryptographicHash::Sha1).toHex());
+      QMutexLocker locker(&mutex);
+      used.insert(name);
+      return dir_path + "/" + name;
+    }
+    /** Reads the header of a cache file, returns false if it isn't one
+     *  of this version */
+    static bool read_header(QDataStream &s, QString &path, QByteArray &hash)
+    {
+      s.setVersion(QDataStream::Qt_4_8);
+      quint32 magic = 0, version = 0;
+      s >> magic >> version;
+      if (magic != MAGIC || version != VERSION)
+        return false;
+      s >> path >> hash;
+      return s.status() == QDataStream::Ok;
+    }
+  public:
+    Model_Cache(const Options &o)
+      : read_only(o.dry_run)
+    {
+      if (o.cache_dir_path.isEmpty())
+        return;
+      dir_path = o.cache_dir_path + "/models";
+      if (read_only)
+        return;
+      QDir dir;
+      if (!dir.mkpath(dir_path)) {
+        QString m("Could not create cache dir: ");
+        m += dir_path;
+        throw runtime_error(m.toUtf8().data());
+      }
+    }
+    bool enabled() const
+    {
+      return !dir_path.isEmpty();
+    }
+    /** Returns false on a miss or if the cache file is damaged */
+    bool load(const Input_File &input, Header &h)
+    {
+      if (!enabled())
+        return false;
+      QString name(filename(input));
+      if (!QFile::exists(name))
+        return false;
+      Input_File file(name);
+      QDataStream s(file.data());
+      QString path;
+      QByteArray hash;
+      if (!read_header(s, path, hash) || hash
+          != QCryptographicHash::hash(input.data(), QCryptographicHash::Sha1))
+        return false;
+      Header x;
+      s >> x.name >> x.brief_desc >> x.desc >> x.copyright >> x.functions
+        >> x.structs >> x.ref_ids;
+      if (s.status() != QDataStream::Ok)
+        return false;
+      h.name = x.name;
+      h.module_name = x.name;
+      h.brief_desc = x.brief_desc;
+      h.desc = x.desc;
+      h.copyright = x.copyright;
+      h.functions.swap(x.functions);
+      h.ref_ids.swap(x.ref_ids);
+      for (int i = 0; i < x.structs.size(); ++i) {
+        h.ref_id_struct_map[x.structs[i].id] = h.structs.size();
+        append_swap(h.structs, x.structs[i]);
+      }
+      return true;
+    }
+    void store(const Input_File &input, const Header &h)
+    {
+      if (!enabled() || read_only)
+        return;
+      QByteArray bytes;
+      QDataStream s(&bytes, QIODevice::WriteOnly);
+      s.setVersion(QDataStream::Qt_4_8);
+      s << quint32(MAGIC) << quint32(VERSION);
+      s << QFileInfo(input.filename()).absoluteFilePath()
+        << QCryptographicHash::hash(input.data(), QCryptographicHash::Sha1);
+      s << h.name << h.brief_desc << h.desc << h.copyright << h.functions
+        << h.structs << h.ref_ids;
+      write_atomically(filename(input), bytes);
+    }
+    /** Removes the files that weren't used in this run and whose input
+     *  doesn't exist anymore, or that were written by another version
+     *
+     * Thus, the cache doesn't grow beyond one file per input.
+     */
+    void prune()
+    {
+      if (!enabled() || read_only)
+        return;
+      QDir dir(dir_path);
+      foreach (const QString &name, dir.entryList(QDir::Files)) {
+        // e.g. the temporary file of a concurrent run, see temp_name()
+        if (used.contains(name) || name.size() != 40)
+          continue;
+        QFile file(dir.filePath(name));
+        if (file.open(QIODevice::ReadOnly)) {
+          QDataStream s(&file);
+          QString path;
+          QByteArray hash;
+          if (read_header(s, path, hash) && QFile::exists(path))
+            continue;
+          file.close();
+        }
+        dir.remove(name);
+      }
+    }
+};
+
+void parse_error(const QString &what, const QString &filename,
+    const QString &detail = QString())
+{
+  QString msg(what);
+  msg += " (";
+  msg += filename;
+  msg += ")";
+  if (!detail.isEmpty()) {
+    msg += ": ";
+    msg += detail;
+  }
+  throw runtime_error(msg.toUtf8().data());
+}
+
+/** Pull parses UTF-8 input, without building QXmlAttributes or copying
+ *  element names
+ */
+void parse_stream(const QByteArray &data, Handler &h, const QString &filename,
+    const char *what)
+{
+  QXmlStreamReader reader(data);
+  while (!reader.atEnd()) {
+    switch (reader.readNext()) {
+      case QXmlStreamReader::StartElement:
+        h.start(reader.name(), reader.attributes());
+        break;
+      case QXmlStreamReader::Characters:
+        h.text(reader.text());
+        break;
+      case QXmlStreamReader::EndElement:
+        h.end();
+        break;
+      default:
+        break;
+    }
+  }
+  if (reader.hasError())
+    parse_error(what, filename, QString("line %1: %2")
+        .arg(reader.lineNumber()).arg(reader.errorString()));
+}
+
+void parse_sax(const QByteArray &data, Handler &h, const QString &filename,
+    const char *what)
+{
+  QBuffer buffer;
+  buffer.setData(data);
+  QXmlInputSource source(&buffer);
+  QXmlSimpleReader reader;
+  reader.setContentHandler(&h);
+  reader.setErrorHandler(&h);
+  if (!reader.parse(source))
+    parse_error(what, filename);
+}
+
+void parse(const Input_File &input, Handler &h, const Options &o,
+    const char *what = "XML Parse error")
+{
+  if (o.use_sax)
+    parse_sax(input.data(), h, input.filename(), what);
+  else
+    parse_stream(input.data(), h, input.filename(), what);
+}
+
+/** Parses a validated main file, unless the cache has it
+ *
+ * Thread-safe, the Handler and the reader are local.
+ */
+void parse_main_input(Header &header, const Input_File &input,
+    const Options &o, Model_Cache &cache)
+{
+  if (cache.load(input, header))
+    return;
+  Handler h(header);
+  parse(input, h, o);
+  cache.store(input, header);
+}
+
+void parse_main_file(Header &header, const Options &o, Validator &validator,
+    Model_Cache &cache)
+{
+  Phase_Timer timer(Stats::PARSE);
+  Input_File input(header.filename);
+  stats.add(Stats::XML_BYTES, input.data().size());
+  validator.validate(input.data(), header.filename, header.base_path);
+  parse_main_input(header, input, o, cache);
+}
+
+/** Parses the structs of a validated referenced file, unless the cache
+ *  has them
+ */
+void parse_ref_input(const Input_File &input, const Options &o,
+    Model_Cache &cache, QVector<Struct> &structs)
+{
+  Header ref_header;
+  if (!cache.load(input, ref_header)) {
+    Handler h(ref_header);
+    parse(input, h, o, "XML Parse error in referenced file");
+    cache.store(input, ref_header);
+  }
+  structs.swap(ref_header.structs);
+}
+
+/** Parses one referenced file with its own reader and handler
+ *
+ * Thus, several referenced files can be parsed concurrently.
+ */
+class Ref_Parser {
+  private:
+    const QVector<QSharedPointer<Input_File> > &inputs;
+    QVector<QVector<Struct> > &results;
+    const Options &o;
+    Model_Cache &cache;
+  public:
+    Ref_Parser(const QVector<QSharedPointer<Input_File> > &inputs,
+        QVector<QVector<Struct> > &results, const Options &o,
+        Model_Cache &cache)
+      : inputs(inputs), results(results), o(o), cache(cache)
+    {
+    }
+    void operator()(int i) const
+    {
+      parse_ref_input(*inputs[i], o, cache, results[i]);
+    }
+};
+
+/** Points the header to the structs of its referenced compounds
+ */
+void link_structs(Header &header, const Compound_Index &index)
+{
+  QStringList ref_ids(header.ref_ids.toList());
+  ref_ids.sort();
+  header.ref_structs.clear();
+  foreach (const QString &ref_id, ref_ids)
+    if (index.contains(ref_id))
+      header.ref_structs += index.file(ref_id);
+}
+
+void parse_refs(Header &header, const Options &o,
+    Validator &validator, Model_Cache &cache, Compound_Index &index,
+    Dependencies &deps)
+{
+  header.compounds = &index;
+  if (!o.enable_follow_refs)
+    return;
+  Phase_Timer timer(Stats::PARSE_REFS);
+  QStringList ref_ids(header.ref_ids.toList());
+  ref_ids.sort();
+
+  QStringList missing_ids;
+  QVector<QSharedPointer<Input_File> > inputs;
+  foreach (const QString &ref_id, ref_ids) {
+    if (index.contains(ref_id))
+      continue;
+    missing_ids << ref_id;
+    QString filename(ref2file(ref_id, header.base_path));
+    deps.add(filename);
+    inputs.push_back(QSharedPointer<Input_File>(new Input_File(filename)));
+    stats.add(Stats::XML_BYTES, inputs.last()->data().size());
+    // validation stays in this thread, like the schema it uses
+    validator.validate(inputs.last()->data(), filename, header.base_path);
+  }
+  QVector<QVector<Struct> > results(missing_ids.size());
+  parallel_for(missing_ids.size(), o.jobs, Ref_Parser(inputs, results, o, cache));
+  for (int i = 0; i < missing_ids.size(); ++i) {
+    stats.add(Stats::STRUCTS, results[i].size());
+    index.add(missing_ids[i], results[i]);
+  }
+
+  link_structs(header, index);
+}
+
+/** Returns the ids of all file compounds an index.xml lists
+ */
+QStringList parse_index(const QString &filename)
+{
+  QStringList ref_ids;
+  Input_File input(filename);
+  QXmlStreamReader reader(input.data());
+  while (!reader.atEnd()) {
+    if (reader.readNext() != QXmlStreamReader::StartElement)
+      continue;
+    if (reader.name() == QLatin1String("compound")
+        && reader.attributes().value(QLatin1String("kind"))
+           == QLatin1String("file"))
+      ref_ids << reader.attributes().value(QLatin1String("refid")).toString();
+  }
+  if (reader.hasError())
+    parse_error("XML Parse error", filename, QString("line %1: %2")
+        .arg(reader.lineNumber()).arg(reader.errorString()));
+  return ref_ids;
+}
+
+bool is_index_file(const QString &filename)
+{
+  return QFileInfo(filename).fileName() == "index.xml";
+}
+
+/** Appends filename to r unless it is already listed */
+void add_input(QStringList &r, QSet<QString> &seen, const QString &filename)
+{
+  QString path(QFileInfo(filename).canonicalFilePath());
+  // i.e. a missing file is reported when it is read
+  if (path.isEmpty())
+    path = filename;
+  if (seen.contains(path))
+    return;
+  seen.insert(path);
+  r << filename;
+}
+
+/** Replaces each index.xml with the file compounds it lists
+ *
+ * A header given twice (e.g. directly and via index.xml) is only
+ * processed once.
+ */
+QStringList expand_inputs(const QStringList &filenames, Dependencies &deps)
+{
+  QStringList r;
+  QSet<QString> seen;
+  foreach (const QString &filename, filenames) {
+    if (!is_index_file(filename)) {
+      add_input(r, seen, filename);
+      continue;
+    }
+    deps.add(filename);
+    QString base_path(QFileInfo(filename).path());
+    foreach (const QString &ref_id, parse_index(filename))
+      add_input(r, seen, ref2file(ref_id, base_path));
+  }
+  return r;
+}
+
+/** Keeps only what the summary page, the see also sections and the
+ *  struct lookup need of a function
+ */
+class Summary_Sink : public Function_Sink {
+  private:
+    Header &h;
+  public:
+    Summary_Sink(Header &h)
+      : h(h)
+    {
+    }
+    void add(Function &f)
+    {
+      f.desc.clear();
+      f.return_desc.clear();
+      f.copyright.clear();
+      f.ret_values.clear();
+      f.see_also.clear();
+      for (int i = 0; i < f.parameters.size(); ++i) {
+        f.parameters[i].brief_desc.clear();
+        f.parameters[i].desc.clear();
+      }
+      append_swap(h.functions, f);
+    }
+};
+
+class Page_Sink : public Function_Sink {
+  private:
+    const Header &h;
+    const Options &opts;
+    Page_Writer &writer;
+  public:
+    Page_Sink(const Header &h, const Options &opts, Page_Writer &writer)
+      : h(h), opts(opts), writer(writer)
+    {
+    }
+    void add(Function &f)
+    {
+      write_function_page(f, h, opts, writer);
+    }
+};
 
-  QString url;
-  QString url_text;
+/** Adds a parsed header to the --stats counters */
+void count(const Header &header)
+{
+  stats.add(Stats::HEADERS);
+  stats.add(Stats::FUNCTIONS, header.functions.size());
+  stats.add(Stats::REFS, header.ref_ids.size());
+}
 
-  bool from_top(size_t i, Tag t)
+/** Writes the pages of a header while parsing it
+ *
+ * The first pass collects the function summaries (for the summary page
+ * and the see also sections) and the referenced structs. The second
+ * pass over the (mapped) input writes each function page as soon as its
+ * memberdef is closed. Thus, only one complete Function is in memory at
+ * a time.
+ */
+void stream_header(Header &header, const Options &o, Validator &validator,
+    Model_Cache &cache, Compound_Index &compounds, Dependencies &deps,
+    Page_Writer &writer)
+{
+  Input_File input(header.filename);
+  stats.add(Stats::XML_BYTES, input.data().size());
+  validator.validate(input.data(), header.filename, header.base_path);
+  Summary_Sink summary(header);
+  Handler h(header, &summary);
   {
-    if (i >= size_t(tag_stack.size()))
-      return false;
-    return tag_stack[tag_stack.size()-i-1] == t;
+    Phase_Timer timer(Stats::PARSE);
+    parse(input, h, o);
   }
-
-  void parse_tag(const QString & qName, const QXmlAttributes & atts )
+  if (o.enable_warnings)
+    header.check(cerr);
   {
-    if (qName == "sectiondef" && atts.value("kind") == "func" ) {
-      tag = TAG_SECTIONDEF_FUNC;
-    } else if (qName == "memberdef") {
-      if (atts.value("kind") == "function")
-        tag = TAG_MEMBERDEF_FUNC;
-      else if (atts.value("kind") == "variable")
-        tag = TAG_MEMBERDEF_VAR;
-      else
-        tag = TAG_IGNORE;
-    } else if (qName == "type") {
-      tag = TAG_TYPE;
-    } else if (qName == "definition") {
-      tag = TAG_DEFINITION;
-    } else if (qName == "name") {
-      tag = TAG_NAME;
-    } else if (qName == "param") {
-      tag = TAG_PARAM;
-    } else if (qName == "type") {
-      tag = TAG_TYPE;
-    } else if (qName == "declname") {
-      tag = TAG_DECLNAME;
-    } else if (qName == "briefdescription") {
-      tag = TAG_BRIEFDESC;
-    } else if (qName == "para") {
-      tag = TAG_PARA;
-    } else if (qName == "detaileddescription") {
-      tag = TAG_DETAILDESC;
-    } else if (qName == "parameterlist" && atts.value("kind") == "param") {
-      tag  = TAG_PARAMETERLIST;
-    } else if (qName == "parameterlist" && atts.value("kind") == "retval") {
-      tag  = TAG_RETVALLIST;
-    } else if  (qName == "parametername") {
-      tag = TAG_PARAMETERNAME;
-    } else if  (qName == "parameterdescription") {
-      tag = TAG_PARAMETERDESC;
-    } else if (qName == "simplesect") {
-      if (atts.value("kind") == "author")
-        tag = TAG_SIMPLESECT_AUTHOR;
-      else if (atts.value("kind") == "return")
-        tag = TAG_SIMPLESECT_RETURN;
-      else if (atts.value("kind") == "copyright")
-        tag = TAG_SIMPLESECT_COPYRIGHT;
-      else if (atts.value("kind") == "see")
-        tag = TAG_SIMPLESECT_SEE;
-      else
-        tag = TAG_IGNORE;
-    } else if (qName == "parameteritem") {
-      tag = TAG_PARAMETERITEM;
-    } else if (qName == "compounddef") {
-      if  (atts.value("kind") == "file")
-        tag = TAG_COMPOUNDDEF_FILE;
-      else if (atts.value("kind") == "struct")
-        tag = TAG_COMPOUNDDEF_STRUCT;
-      else
-        tag = TAG_IGNORE;
-    } else if (qName == "compoundname") {
-      tag = TAG_COMPOUNDNAME;
-    } else if (qName == "ulink") {
-      tag = TAG_ULINK;
-    } else if (qName == "ref") {
-      if (atts.value("kindref") == "member") {
-        tag = TAG_REF_MEMBER;
-      } else
-        tag = TAG_REF;
-    } else if (qName == "argsstring") {
-        tag = TAG_ARGSTRING;
-    } else {
-      tag = TAG_IGNORE;
-    }
+    Phase_Timer timer(Stats::SORT);
+    header.sort(o);
   }
+  count(header);
 
-  bool startElement ( const QString & namespaceURI, const QString & localName, const QString & qName, const QXmlAttributes & atts )
-  {
+  parse_refs(header, o, validator, cache, compounds, deps);
 
-    //cout << qName.toUtf8().data() << '\n';
-    parse_tag(qName, atts);
-    if (tag != TAG_IGNORE && tag != TAG_ULINK && tag != TAG_REF && tag != TAG_REF_MEMBER)
-      buffer.clear();
-    tag_stack.push(tag);
+  // parsing and rendering are interleaved in the second pass
+  Phase_Timer timer(Stats::PRINT_MAN);
+  write_summary_pages(header, o, writer);
+  write_struct_pages(header, o, writer);
 
-    switch (tag) {
-      case TAG_MEMBERDEF_FUNC:
-        f = Function();
-        break;
-      case TAG_PARAM:
-        p = Parameter();
-        break;
-      case TAG_REF:
-        if (from_top(1, TAG_TYPE) && from_top(2, TAG_PARAM)
-            && atts.value("kindref") == "compound") {
-          p.compound_ref = atts.value("refid");
-          f.ref_ids.push_back(p.compound_ref);
-          h.ref_ids.insert(p.compound_ref);
-        }
-        break;
-      case TAG_REF_MEMBER:
-        if (from_top(1, TAG_PARA) && from_top(2, TAG_DETAILDESC)
-            && from_top(3, TAG_MEMBERDEF_FUNC) ) {
-          f.see_also.push_back(See_Also(atts.value("refid")));
-        }
-        break;
-      case TAG_PARAMETERNAME:
-        pi = Parameter_Item();
-        pi.dir = DIR_NONE;
-        if (atts.value("direction") == "in")
-          pi.dir = DIR_IN;
-        else if (atts.value("direction") == "out")
-          pi.dir = DIR_OUT;
-        break;
-      case TAG_ULINK:
-        url = atts.value("url");
-        break;
-      case TAG_MEMBERDEF_VAR:
-        member = Member();
-        break;
-      case TAG_COMPOUNDDEF_STRUCT:
-        st = Struct();
-        st.id = atts.value("id");
-        break;
-    }
+  Header scratch;
+  Page_Sink pages(header, o, writer);
+  Handler h2(scratch, &pages);
+  parse(input, h2, o);
+}
 
-    return true;
+/** Parses filename and its references, then dumps the model or writes
+ *  the pages, writer is 0 with --dump */
+void process_header(Header &header, const QString &filename,
+    const Options &o, Validator &validator, Model_Cache &cache,
+    Compound_Index &compounds, Dependencies &deps, Page_Writer *writer)
+{
+  deps.add(filename);
+  header.filename = filename;
+  header.base_path = QFileInfo(filename).path();
+  if (o.streaming && !o.just_dump) {
+    stream_header(header, o, validator, cache, compounds, deps, *writer);
+    return;
   }
-
-  bool  characters ( const QString & ch )
+  parse_main_file(header, o, validator, cache);
+  if (o.enable_warnings)
+    header.check(cerr);
   {
-    if (tag == TAG_ULINK) {
-      url_text.append(ch);
-      return true;
-    }
-    buffer.append(ch);
-    return true;
+    Phase_Timer timer(Stats::SORT);
+    header.sort(o);
   }
+  count(header);
 
-  bool  endElement ( const QString & namespaceURI, const QString & localName, const QString & qName )
-  {
-    //cout << buffer.toUtf8().data() << '\n';
+  parse_refs(header, o, validator, cache, compounds, deps);
 
-    switch (tag) {
-      case TAG_TYPE:
-        if (from_top(1, TAG_MEMBERDEF_FUNC))
-          f.type = buffer;
-        else if (from_top(1, TAG_PARAM))
-          p.type = buffer;
-        else if (from_top(1, TAG_MEMBERDEF_VAR))
-          member.type = buffer;
-        break;
-      case TAG_NAME:
-        if (from_top(1, TAG_MEMBERDEF_FUNC))
-          f.name = buffer;
-        else if (from_top(1,TAG_MEMBERDEF_VAR))
-          member.name = buffer;
-        break;
-      case TAG_ARGSTRING:
-        if (from_top(1,TAG_MEMBERDEF_VAR))
-          member.arg_string = buffer;
-        break;
-      case TAG_MEMBERDEF_FUNC:
-        h.functions.push_back(f);
-        break;
-      case TAG_BRIEFDESC:
-        // usually a para inside is used
-        // if (from_top(1, TAG_MEMBERDEF_FUNC))
-        //  f.brief_desc += buffer;
-        break;
-      case TAG_PARA:
-        if (from_top(1, TAG_BRIEFDESC)) {
-          if (from_top(2, TAG_MEMBERDEF_FUNC))
-            f.brief_desc = buffer;
-          else if (from_top(2, TAG_PARAM))
-            p.brief_desc = buffer;
-          else if (from_top(2, TAG_COMPOUNDDEF_FILE))
-            h.brief_desc = buffer;
-          else if (from_top(2, TAG_MEMBERDEF_VAR))
-            member.brief_desc = buffer;
-          else if (from_top(2, TAG_COMPOUNDDEF_STRUCT))
-            st.brief_desc = buffer;
+  Phase_Timer timer(Stats::PRINT_MAN);
+  if (o.just_dump)
+    print_dump(cout, header);
+  else
+    print_man(header, o, *writer);
+}
+
+/** Fixed set of threads, each with its own queue of tasks
+ *
+ * A thread runs the most expensive task of its own queue and, when that
+ * is empty, steals the most expensive task of all the other queues.
+ * Thus, big items start first and no thread idles while work is queued
+ * anywhere. All tasks are started by the main thread, i.e. there is no
+ * producer to keep them close to, thus they are spread round robin over
+ * the queues.
+ */
+class Work_Stealing_Pool {
+  private:
+    struct Task {
+      qint64 cost;
+      QRunnable *runnable;
+      bool operator<(const Task &o) const
+      {
+        return cost < o.cost;
+      }
+    };
+    struct Queue {
+      QMutex mutex;
+      QVector<Task> heap; // max-heap by cost
+    };
+    class Worker : public QThread {
+      private:
+        Work_Stealing_Pool &pool;
+        int index;
+      public:
+        Worker(Work_Stealing_Pool &pool, int index)
+          : pool(pool), index(index)
+        {
         }
-        else if (from_top(1, TAG_DETAILDESC)) {
-          if (from_top(2, TAG_MEMBERDEF_FUNC)) {
-            f.desc += buffer;
-            f.desc += '\n';
-          } else if (from_top(2, TAG_COMPOUNDDEF_FILE)) {
-            h.desc += buffer;
-            h.desc += '\n';
-          } else if (from_top(2, TAG_MEMBERDEF_VAR)) {
-            member.desc += buffer;
-            member.desc += '\n';
-          } else if (from_top(2, TAG_COMPOUNDDEF_STRUCT)) {
-            st.desc += buffer;
-            st.desc += '\n';
+        void run()
+        {
+          pool.work(index);
+        }
+    };
+
+    QVector<Queue*> queues;
+    QVector<Worker*> workers;
+    QMutex mutex;
+    QWaitCondition wake;
+    int queued;
+    int next; // queue of the next task
+    bool stopped;
+
+    Work_Stealing_Pool(const Work_Stealing_Pool &);
+    Work_Stealing_Pool &operator=(const Work_Stealing_Pool &);
+
+    bool pop(Queue &q, Task &t)
+    {
+      QMutexLocker locker(&q.mutex);
+      if (q.heap.isEmpty())
+        return false;
+      std::pop_heap(q.heap.begin(), q.heap.end());
+      t = q.heap.last();
+      q.heap.pop_back();
+      return true;
+    }
+    /** Cost of the most expensive task of q, or -1 */
+    qint64 top(Queue &q)
+    {
+      QMutexLocker locker(&q.mutex);
+      return q.heap.isEmpty() ? -1 : q.heap.first().cost;
+    }
+    bool take(int i, Task &t)
+    {
+      bool found = pop(*queues[i], t);
+      while (!found) {
+        int victim = -1;
+        qint64 max = -1;
+        for (int k = 0; k < queues.size(); ++k) {
+          qint64 c = k == i ? -1 : top(*queues[k]);
+          if (c > max) {
+            max = c;
+            victim = k;
           }
         }
-        else if (from_top(1, TAG_SIMPLESECT_AUTHOR)
-              && from_top(3, TAG_DETAILDESC)
-            && from_top(4, TAG_MEMBERDEF_FUNC)) {
-          f.authors.push_back(buffer.trimmed());
-          buffer.clear();
+        if (victim < 0)
+          return false;
+        // another thread may have been faster, then look again
+        found = pop(*queues[victim], t);
+      }
+      QMutexLocker locker(&mutex);
+      --queued;
+      return true;
+    }
+    void work(int i)
+    {
+      for (;;) {
+        {
+          // checked before each task, i.e. the queued ones are dropped
+          QMutexLocker locker(&mutex);
+          while (queued <= 0 && !stopped)
+            wake.wait(&mutex);
+          if (stopped)
+            return;
         }
-        else if (from_top(1, TAG_PARAMETERDESC)) {
-          pi.desc += buffer;
-          pi.desc += '\n';
-          buffer.clear();
+        Task t;
+        if (take(i, t)) {
+          t.runnable->run();
+          if (t.runnable->autoDelete())
+            delete t.runnable;
         }
-        else if (from_top(1, TAG_SIMPLESECT_RETURN)) {
-          f.return_desc = buffer;
-          buffer.clear();
+      }
+    }
+  public:
+    Work_Stealing_Pool(int n)
+      : queued(0), next(0), stopped(false)
+    {
+      for (int i = 0; i < n; ++i)
+        queues.push_back(new Queue);
+      for (int i = 0; i < n; ++i) {
+        workers.push_back(new Worker(*this, i));
+        workers.last()->start();
+      }
+    }
+    /** Waits for the running tasks, the queued ones are dropped */
+    ~Work_Stealing_Pool()
+    {
+      {
+        QMutexLocker locker(&mutex);
+        stopped = true;
+        wake.wakeAll();
+      }
+      foreach (Worker *w, workers) {
+        w->wait();
+        delete w;
+      }
+      foreach (Queue *q, queues) {
+        foreach (const Task &t, q->heap)
+          if (t.runnable->autoDelete())
+            delete t.runnable;
+        delete q;
+      }
+    }
+    void start(QRunnable *r, qint64 cost)
+    {
+      Task t;
+      t.cost = cost;
+      t.runnable = r;
+      int i;
+      {
+        QMutexLocker locker(&mutex);
+        i = next;
+        next = (next + 1) % queues.size();
+      }
+      {
+        QMutexLocker locker(&queues[i]->mutex);
+        queues[i]->heap.push_back(t);
+        std::push_heap(queues[i]->heap.begin(), queues[i]->heap.end());
+      }
+      QMutexLocker locker(&mutex);
+      ++queued;
+      wake.wakeOne();
+    }
+};
+
+/** Sorts the inputs by size, largest first, ties by name
+ *
+ * The pipeline starts the big ones first, the tar file lists the
+ * headers in this order.
+ */
+QStringList largest_first(const QStringList &inputs)
+{
+  QVector<QPair<qint64, QString> > sized;
+  foreach (const QString &filename, inputs)
+    sized.push_back(qMakePair(-QFileInfo(filename).size(), filename));
+  qSort(sized.begin(), sized.end());
+  QStringList r;
+  for (int i = 0; i < sized.size(); ++i)
+    r << sized[i].second;
+  return r;
+}
+
+/** Processes many headers with parse, validate, ref-follow, render and
+ *  write as overlapping stages
+ *
+ * The main thread reads the inputs, follows the references and hands
+ * out the work. The pool validates and parses the headers and the
+ * referenced files and renders the pages, which the Page_Writer threads
+ * write. The inputs are started
+ * largest first and each page is a task of its own, thus a giant
+ * header doesn't leave the other threads idle at the end.
+ *
+ * The stages are connected by bounded queues: at most MAX_IN_FLIGHT
+ * headers per thread are between reading and written, the events back
+ * to the main thread and the pages to write are bounded as well.
+ */
+class Pipeline {
+  private:
+    struct Job {
+      Header header;
+      QSharedPointer<Input_File> input; // until parsed
+      int refs; // referenced compounds that are not yet in the index
+      QAtomicInt pages; // not yet written
+    };
+    struct Event {
+      enum Kind { PARSED, REF_PARSED, WRITTEN, FAILED } kind;
+      Job *job;
+      QString ref_id;
+      QVector<Struct> structs;
+      QString error;
+    };
+    enum { MAX_IN_FLIGHT = 2, MAX_EVENTS = 64 };
+
+    class Parse_Task : public QRunnable {
+      private:
+        Pipeline &p;
+        Job *job;
+      public:
+        Parse_Task(Pipeline &p, Job *job)
+          : p(p), job(job)
+        {
         }
-        else if (from_top(1, TAG_SIMPLESECT_COPYRIGHT)) {
-          if (from_top(4, TAG_COMPOUNDDEF_FILE)) {
-            h.copyright = buffer;
-            buffer.clear();
-          } else if (from_top(3, TAG_DETAILDESC) 
-              && from_top(4, TAG_MEMBERDEF_FUNC)) {
-            f.copyright = buffer;
-            buffer.clear();
+        void run()
+        {
+          Event e;
+          e.kind = Event::PARSED;
+          e.job = job;
+          try {
+            {
+              Task_Timer timer(Stats::VALIDATE);
+              p.validator.check(job->input->data(), job->header.filename,
+                  job->header.base_path);
+            }
+            {
+              Task_Timer timer(Stats::PARSE);
+              parse_main_input(job->header, *job->input, p.o, p.cache);
+            }
+            Task_Timer timer(Stats::SORT);
+            job->header.sort(p.o);
+          } catch (const exception &x) {
+            e.kind = Event::FAILED;
+            e.error = x.what();
           }
+          p.post(e);
         }
-        else if (from_top(1, TAG_SIMPLESECT_SEE)
-            && from_top(3, TAG_DETAILDESC)
-            && from_top(4, TAG_MEMBERDEF_FUNC)) {
-          f.see_also.push_back(See_Also());
-          f.see_also.last().set_name(buffer);
-          buffer.clear();
+    };
+    class Ref_Task : public QRunnable {
+      private:
+        Pipeline &p;
+        QString ref_id;
+        QString filename;
+        QString base_path;
+        QSharedPointer<Input_File> input;
+      public:
+        Ref_Task(Pipeline &p, const QString &ref_id, const QString &filename,
+            const QString &base_path, const QSharedPointer<Input_File> &input)
+          : p(p), ref_id(ref_id), filename(filename), base_path(base_path),
+          input(input)
+        {
         }
-        break;
-      case TAG_DECLNAME:
-        p.name = buffer;
-        break;
-      case TAG_PARAM:
-        f.parameters.push_back(p);
-        break;
-      case TAG_PARAMETERNAME:
-        pi.name = buffer;
-        break;
-      case TAG_PARAMETERITEM:
-        if (from_top(1, TAG_PARAMETERLIST)) {
-            int i = f.index_of_parameter(pi.name);
-            if (i == -1) {
-              qWarning() << "Can't find param name: " << pi.name;
-            } else {
-              f.parameters[i] = pi;
+        void run()
+        {
+          Event e;
+          e.kind = Event::REF_PARSED;
+          e.job = 0;
+          e.ref_id = ref_id;
+          try {
+            {
+              Task_Timer timer(Stats::VALIDATE);
+              p.validator.check(input->data(), filename, base_path);
             }
+            Task_Timer timer(Stats::PARSE_REFS);
+            parse_ref_input(*input, p.o, p.cache, e.structs);
+          } catch (const exception &x) {
+            e.kind = Event::FAILED;
+            e.error = x.what();
+          }
+          p.post(e);
         }
-        if (from_top(1, TAG_RETVALLIST)) {
-          Parameter a;
-          a = pi;
-          a.name = pi.name;
-          f.ret_values.push_back(a);
-        }
-        break;
-      case TAG_COMPOUNDNAME:
-        if (from_top(1, TAG_COMPOUNDDEF_STRUCT)) {
-          st.name = buffer;
-        } else if (from_top(1, TAG_COMPOUNDDEF_FILE)) {
-          h.name = buffer;
-          h.module_name = h.name; // h.name.remove(".h").toUpper();
-        }
-        break;
-      case TAG_ULINK:
-        if (!url.isEmpty()) {
-          if (url.startsWith("mailto:")) {
-            buffer += "<";
-            buffer += url.mid(7);
-            buffer += ">";
-          } else
-            buffer += url;
-        }
-        url.clear();
-        url_text.clear();
-        break;
-      case TAG_COMPOUNDDEF_STRUCT:
-        h.ref_id_struct_map[st.id] = h.structs.size();
-        h.structs.push_back(st);
-        break;
-      case TAG_MEMBERDEF_VAR:
-        if (from_top(2, TAG_COMPOUNDDEF_STRUCT)) {
-          st.members.push_back(member);
+    };
+    /** Renders and writes one page, -1 is the summary page */
+    class Page_Task : public QRunnable {
+      private:
+        Pipeline &p;
+        Job *job;
+        int i;
+      public:
+        Page_Task(Pipeline &p, Job *job, int i)
+          : p(p), job(job), i(i)
+        {
         }
-        break;
-      case TAG_REF_MEMBER:
-        if (from_top(1, TAG_PARA) && from_top(2, TAG_DETAILDESC)
-            && from_top(3, TAG_MEMBERDEF_FUNC) ) {
-          f.see_also.last().set_name_last(buffer);
+        void run()
+        {
+          Event e;
+          e.kind = Event::WRITTEN;
+          e.job = job;
+          try {
+            Task_Timer timer(Stats::PRINT_MAN);
+            if (i < 0)
+              write_summary_pages(job->header, p.o, p.writer);
+            else
+              write_function_page(job->header.functions[i], job->header,
+                  p.o, p.writer);
+          } catch (const exception &x) {
+            e.kind = Event::FAILED;
+            e.error = x.what();
+            p.post(e);
+            return;
+          }
+          if (!job->pages.deref())
+            p.post(e);
         }
-        break;
+    };
+
+    const Options &o;
+    Validator &validator;
+    Model_Cache &cache;
+    Compound_Index &compounds;
+    Dependencies &deps;
+    Page_Writer &writer;
+
+    QVector<Event> events;
+    bool closed; // i.e. the events are dropped
+    QMutex mutex;
+    QWaitCondition not_empty;
+    QWaitCondition not_full;
+
+    QMap<QString, QList<Job*> > waiting; // by ref id being parsed
+    QSet<Job*> jobs; // in flight
+    Work_Stealing_Pool *pool;
+
+    void post(const Event &e)
+    {
+      QMutexLocker locker(&mutex);
+      while (events.size() >= MAX_EVENTS && !closed)
+        not_full.wait(&mutex);
+      if (closed)
+        return;
+      events.push_back(e);
+      not_empty.wakeOne();
+    }
+    Event take()
+    {
+      QMutexLocker locker(&mutex);
+      while (events.isEmpty())
+        not_empty.wait(&mutex);
+      Event e(events.first());
+      events.remove(0);
+      not_full.wakeOne();
+      return e;
     }
 
-    tag_stack.pop();
-    if (!tag_stack.empty())
-      tag = tag_stack.top();
-    return true;
-  }
+    void read(const QString &filename)
+    {
+      Job *job = new Job;
+      jobs.insert(job);
+      job->refs = 0;
+      Header &h = job->header;
+      deps.add(filename);
+      h.filename = filename;
+      h.base_path = QFileInfo(filename).path();
+      job->input = QSharedPointer<Input_File>(new Input_File(filename));
+      stats.add(Stats::XML_BYTES, job->input->data().size());
+      pool->start(new Parse_Task(*this, job), job->input->data().size());
+    }
+    void follow_refs(Job *job)
+    {
+      Header &h = job->header;
+      h.compounds = &compounds;
+      if (!o.enable_follow_refs)
+        return;
+      QStringList ref_ids(h.ref_ids.toList());
+      ref_ids.sort();
+      foreach (const QString &ref_id, ref_ids) {
+        if (compounds.contains(ref_id))
+          continue;
+        ++job->refs;
+        bool started = waiting.contains(ref_id);
+        waiting[ref_id] << job;
+        if (started)
+          continue;
+        QString filename(ref2file(ref_id, h.base_path));
+        deps.add(filename);
+        QSharedPointer<Input_File> input(new Input_File(filename));
+        stats.add(Stats::XML_BYTES, input->data().size());
+        pool->start(new Ref_Task(*this, ref_id, filename, h.base_path, input),
+            input->data().size());
+      }
+    }
+    void render(Job *job)
+    {
+      Header &h = job->header;
+      Task_Timer timer(Stats::PRINT_MAN);
+      link_structs(h, compounds);
+      // here, since two headers may refer to the same struct
+      write_struct_pages(h, o, writer);
+      QVector<int> mine; // i.e. of this shard
+      for (int i = 0; i < h.functions.size(); ++i)
+        if (o.in_shard(h.functions[i].name))
+          mine.push_back(i);
+      job->pages.fetchAndStoreOrdered(mine.size() + 1);
+      pool->start(new Page_Task(*this, job, -1),
+          h.desc.size() + 64 * h.functions.size() + 256);
+      foreach (int i, mine) {
+        const Function &f = h.functions[i];
+        pool->start(new Page_Task(*this, job, i), f.desc.size()
+            + f.brief_desc.size() + 64 * f.parameters.size() + 256);
+      }
+    }
+    void handle(Event &e)
+    {
+      switch (e.kind) {
+        case Event::PARSED:
+          {
+            Job *job = e.job;
+            job->input.clear();
+            if (o.enable_warnings)
+              job->header.check(cerr);
+            count(job->header);
+            follow_refs(job);
+            if (!job->refs)
+              render(job);
+          }
+          break;
+        case Event::REF_PARSED:
+          stats.add(Stats::STRUCTS, e.structs.size());
+          compounds.add(e.ref_id, e.structs);
+          foreach (Job *job, waiting.take(e.ref_id))
+            if (!--job->refs)
+              render(job);
+          break;
+        case Event::WRITTEN:
+          writer.header_done(e.job->header);
+          jobs.remove(e.job);
+          delete e.job;
+          break;
+        case Event::FAILED:
+          throw runtime_error(e.error.toUtf8().data());
+      }
+    }
+
+    Pipeline(const Pipeline &);
+    Pipeline &operator=(const Pipeline &);
+  public:
+    Pipeline(const Options &o, Validator &validator, Model_Cache &cache,
+        Compound_Index &compounds, Dependencies &deps, Page_Writer &writer)
+      : o(o), validator(validator), cache(cache), compounds(compounds),
+      deps(deps), writer(writer), closed(false), pool(0)
+    {
+    }
+    ~Pipeline()
+    {
+      {
+        QMutexLocker locker(&mutex);
+        closed = true;
+        not_full.wakeAll();
+      }
+      // first, since the running tasks still use the jobs
+      delete pool;
+      foreach (Job *job, jobs)
+        delete job;
+    }
+    /** Processes the inputs in the given order, see largest_first() */
+    void run(const QStringList &inputs)
+    {
+      pool = new Work_Stealing_Pool(o.jobs);
+      int max_jobs = MAX_IN_FLIGHT * o.jobs;
+      int next = 0;
+      while (next < inputs.size() || !jobs.isEmpty()) {
+        while (next < inputs.size() && jobs.size() < max_jobs)
+          read(inputs[next++]);
+        Event e(take());
+        handle(e);
+      }
+    }
 };
 
-void validate(QFile &file, const Options &o)
-{
-  if (!o.enable_validate)
-    return;
+#include "main.h"
 
-  QString xsd_filename(o.base_path + "/compound.xsd");
-  QFile xsd_file(xsd_filename);
-  if (!xsd_file.exists()) {
-    QString msg("XSD ");
-    msg += xsd_filename;
-    msg += " does not exist";
-    throw runtime_error(msg.toUtf8().data());
-  }
+/** Regenerates the pages that depend on changed XML inputs
+ *
+ * The parsed headers stay in memory. A changed file compound is parsed
+ * again and all its pages are written. A changed struct compound
+ * replaces its structs in the compound index, and only the summary
+ * pages and the function pages that refer to it are written again.
+ *
+ * Doxygen writes many files in a row, thus inotify events are collected
+ * until none arrived for DELAY_MS.
+ *
+ * The strings of the replaced headers stay in the String_Pool. Thus,
+ * when it has grown to twice its size after the last full pass, the
+ * pool is cleared and all headers are read again, mostly from the
+ * model cache. Unchanged pages aren't written then.
+ */
+class Watch {
+  private:
+    Options o;
+    Dependencies deps;
+    Validator validator;
+    Model_Cache cache;
+    Compound_Index compounds;
+    Page_Writer writer;
+    QMap<QString, QSharedPointer<Header> > headers; // by absolute filename
+    QSet<QString> changed; // absolute filenames
+    QMap<int, QString> dirs; // by inotify watch descriptor
+    int fd;
+    QSocketNotifier *notifier;
+    QTimer timer;
+    int pool_limit; // see rebuild()
+    enum { DELAY_MS = 200, MIN_POOL_LIMIT = 64 * 1024 };
 
-  QUrl schemaUrl(QUrl::fromLocalFile(xsd_filename));
-  QXmlSchema schema;
-  schema.load(schemaUrl);
+    Watch(const Watch &);
+    Watch &operator=(const Watch &);
 
-  if (schema.isValid()) {
-    file.open(QIODevice::ReadOnly);
-    QXmlSchemaValidator validator(schema);
-    if (validator.validate(&file, QUrl::fromLocalFile(file.fileName()))) {
-      file.seek(0);
-    } else {
-      QString msg("XML input ");
-      msg += file.fileName();
-      msg += " is invalid";
-      throw runtime_error(msg.toUtf8().data());
-    }
-  } else {
-    QString msg("XSD ");
-    msg += xsd_filename;
-    msg += " is invalid";
-    throw runtime_error(msg.toUtf8().data());
-  }
+    static QString absolute(const QString &filename)
+    {
+      return QFileInfo(filename).absoluteFilePath();
+    }
+    void finish_pass()
+    {
+      validator.save();
+      writer.finish();
+      if (!o.depfile_path.isEmpty() && !o.dry_run)
+        deps.write(o.depfile_path, writer.outputs());
+      writer.restart();
+    }
+    /** Reads all headers again into a cleared String_Pool */
+    void rebuild()
+    {
+      QStringList filenames(headers.keys());
+      headers.clear();
+      compounds.clear();
+      atoms.clear();
+      writer.claim(struct_owner);
+      foreach (const QString &filename, filenames)
+        update_header(filename);
+      finish_pass();
+      pool_limit = qMax(2 * atoms.used(), int(MIN_POOL_LIMIT));
+    }
+    void add_dir(const QString &path)
+    {
+#ifdef Q_OS_LINUX
+      if (dirs.values().contains(path))
+        return;
+      int wd = inotify_add_watch(fd, QFile::encodeName(path).data(),
+          IN_CLOSE_WRITE | IN_MOVED_TO);
+      if (wd < 0) {
+        QString m("Could not watch directory: ");
+        m += path;
+        throw runtime_error(m.toUtf8().data());
+      }
+      dirs[wd] = path;
+#endif
+    }
+    void update_header(const QString &filename)
+    {
+      QSharedPointer<Header> header(new Header);
+      process_header(*header, filename, o, validator, cache, compounds, deps,
+          &writer);
+      headers[absolute(filename)] = header;
+    }
+    /** Replaces the structs of a referenced compound and collects the ids
+     *  of the old and new ones */
+    void update_compound(const QString &ref_id, const QString &filename,
+        QSet<QString> &struct_ids)
+    {
+      foreach (const Struct *st, compounds.file(ref_id))
+        struct_ids.insert(st->id);
+      Input_File input(filename);
+      validator.validate(input.data(), filename, QFileInfo(filename).path());
+      Header ref_header;
+      if (!cache.load(input, ref_header)) {
+        Handler h(ref_header);
+        parse(input, h, o, "XML Parse error in referenced file");
+        cache.store(input, ref_header);
+      }
+      foreach (const Struct &st, ref_header.structs)
+        struct_ids.insert(st.id);
+      compounds.add(ref_id, ref_header.structs);
+    }
+    void update_pages(Header &h, const QSet<QString> &ref_ids,
+        const QSet<QString> &struct_ids)
+    {
+      bool written = false;
+      if (!QSet<QString>(h.ref_ids).intersect(ref_ids).isEmpty()) {
+        link_structs(h, compounds);
+        write_summary_pages(h, o, writer);
+        write_struct_pages(h, o, writer);
+        written = true;
+      }
+      foreach (const Function &f, h.functions) {
+        foreach (const QString &id, f.ref_ids) {
+          if (struct_ids.contains(id)) {
+            write_function_page(f, h, o, writer);
+            written = true;
+            break;
+          }
+        }
+      }
+      if (written)
+        writer.partial(h.name);
+    }
+  public:
+    Watch(const Options &opts, QObject *receiver)
+      : o(opts), validator(o, deps), cache(o), writer(o), fd(-1), notifier(0),
+        pool_limit(0)
+    {
+#ifdef Q_OS_LINUX
+      fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+      if (fd < 0)
+        throw runtime_error("Could not initialize inotify");
+      notifier = new QSocketNotifier(fd, QSocketNotifier::Read, receiver);
+      QObject::connect(notifier, SIGNAL(activated(int)),
+          receiver, SLOT(read_events()));
+      timer.setSingleShot(true);
+      timer.setInterval(DELAY_MS);
+      QObject::connect(&timer, SIGNAL(timeout()), receiver, SLOT(regenerate()));
+#else
+      throw runtime_error("--watch is only supported on Linux");
+#endif
+    }
+    ~Watch()
+    {
+      delete notifier;
+#ifdef Q_OS_LINUX
+      if (fd >= 0)
+        ::close(fd);
+#endif
+    }
+
+    /** Generates all pages and starts watching the input directories */
+    void start()
+    {
+      QStringList inputs(expand_inputs(o.filenames, deps));
+      writer.claim(struct_owner);
+      foreach (const QString &filename, inputs) {
+        update_header(filename);
+        add_dir(QFileInfo(filename).path());
+      }
+      finish_pass();
+      pool_limit = qMax(2 * atoms.used(), int(MIN_POOL_LIMIT));
+      cerr << "Watching for changes ...\n";
+    }
+
+    void read_events()
+    {
+#ifdef Q_OS_LINUX
+      union {
+        struct inotify_event event;
+        char bytes[16 * 1024];
+      } buffer;
+      for (;;) {
+        ssize_t n = ::read(fd, buffer.bytes, sizeof buffer.bytes);
+        if (n <= 0)
+          break;
+        for (const char *p = buffer.bytes; p < buffer.bytes + n; ) {
+          const struct inotify_event *e =
+            reinterpret_cast<const struct inotify_event*>(p);
+          p += sizeof(struct inotify_event) + e->len;
+          if (!e->len || !dirs.contains(e->wd))
+            continue;
+          QString name(QFile::decodeName(e->name));
+          if (name.endsWith(".xml"))
+            changed.insert(absolute(dirs[e->wd] + "/" + name));
+        }
+      }
+      if (!changed.isEmpty())
+        timer.start();
+#endif
+    }
+
+    /** Referenced compounds first, such that a changed header already
+     *  sees the new structs */
+    void regenerate()
+    {
+      QSet<QString> files(changed);
+      changed.clear();
+      try {
+        QSet<QString> ref_ids;
+        QSet<QString> struct_ids;
+        foreach (const QString &filename, files) {
+          QString ref_id(QFileInfo(filename).completeBaseName());
+          if (headers.contains(filename) || !compounds.contains(ref_id))
+            continue;
+          update_compound(ref_id, filename, struct_ids);
+          ref_ids.insert(ref_id);
+        }
+        if (!ref_ids.isEmpty()) {
+          for (QMap<QString, QSharedPointer<Header> >::iterator i =
+              headers.begin(); i != headers.end(); ++i)
+            update_pages(*i.value(), ref_ids, struct_ids);
+        }
+        foreach (const QString &filename, files) {
+          if (headers.contains(filename))
+            update_header(filename);
+        }
+        // i.e. the structs of the unchanged headers weren't written
+        writer.partial(struct_owner);
+        finish_pass();
+        if (atoms.used() > pool_limit)
+          rebuild();
+      } catch (const exception &e) {
+        // the next pass finishes what this one wrote
+        cerr << "Exception: " << e.what() << '\n';
+      }
+    }
+};
+
+Main::Main()
+  : watch(0)
+{
 }
 
-void parse_main_file(QXmlReader &reader, Handler &h, const Options &o)
+Main::~Main()
 {
-  QFile file(o.filename);
-  validate(file, o);
-  QXmlInputSource source(&file);
-  reader.setContentHandler(&h);
-  reader.setErrorHandler(&h);
-  bool pret = reader.parse(source);
-  if (!pret) {
-    QString msg("XML Parse error (");
-    msg += o.filename;
-    msg += ")";
-    throw runtime_error(msg.toUtf8().data());
-  }
+  delete watch;
 }
 
-void parse_refs(QXmlReader &reader, Handler &h, const Options &o)
+void Main::read_events()
 {
-  if (!o.enable_follow_refs)
-    return;
-  foreach (const QString &ref_id, h.h.ref_ids) {
-    QFile file(ref2file(ref_id, o));
-    validate(file, o);
-    QXmlInputSource source(&file);
-    bool pret = reader.parse(source);
-    if (!pret) {
-      QString msg("XML Parse error in referenced file (");
-      msg += file.fileName();
-      msg += ")";
-      throw runtime_error(msg.toUtf8().data());
-    }
-  }
+  watch->read_events();
 }
 
-#include "main.h"
+void Main::regenerate()
+{
+  watch->regenerate();
+}
 
 void Main::run()
 {
@@ -1339,22 +5710,52 @@ void Main::run()
     Options o;
     o.parse(arg_list);
 
-    QXmlSimpleReader reader;
-    Header header;
-    Handler h(header);
-    parse_main_file(reader, h, o);
-    if (o.enable_warnings)
-      header.check(cerr);
-    header.sort(o);
-
-    parse_refs(reader, h, o);
+    if (o.watch) {
+      o.check_create_output_dir();
+      watch = new Watch(o, this);
+      watch->start();
+      return; // i.e. keep the event loop running
+    }
 
-    if (o.just_dump)
-      print_dump(cout, header);
-    else {
+    Dependencies deps;
+    QStringList inputs(expand_inputs(o.filenames, deps));
+    if (!o.just_dump && o.tar_path.isEmpty())
       o.check_create_output_dir();
-      print_man(header, o);
+
+    Validator validator(o, deps);
+    Model_Cache cache(o);
+    Compound_Index compounds;
+    // i.e. --dump neither reads the manifest nor starts writer threads
+    QScopedPointer<Page_Writer> writer;
+    if (!o.just_dump) {
+      writer.reset(new Page_Writer(o));
+      // i.e. all struct pages still referenced are written in this run
+      writer->claim(struct_owner);
+      // i.e. the same order, with or without the pipeline
+      inputs = largest_first(inputs);
+      writer->set_order(inputs);
+    }
+    if (o.jobs > 1 && inputs.size() > 1 && !o.just_dump && !o.streaming) {
+      Pipeline pipeline(o, validator, cache, compounds, deps, *writer);
+      pipeline.run(inputs);
+    } else {
+      foreach (const QString &filename, inputs) {
+        Header header;
+        process_header(header, filename, o, validator, cache, compounds,
+            deps, writer.data());
+        if (writer)
+          writer->header_done(header);
+      }
+    }
+    validator.save();
+    cache.prune();
+    if (writer) {
+      writer->finish();
+      if (!o.depfile_path.isEmpty() && !o.dry_run)
+        deps.write(o.depfile_path, writer->outputs());
     }
+    if (o.print_stats)
+      stats.print(cerr);
 
   } catch (const exception &e) {
     cerr << "Exception: " << e.what() << '\n';
@@ -11,12 +11,19 @@
 
 #include <QObject>
 
+class Watch;
+
 class Main : public QObject {
   Q_OBJECT
   private:
+    Watch *watch;
   public:
+    Main();
+    ~Main();
   public slots:
     void run();
+    void read_events();
+    void regenerate();
 };
 
 
@@ -2,14 +2,32 @@ TEMPLATE = app
 TARGET = doxy2man
 QT += xml
 QT += xmlpatterns
+LIBS += -lz
+
+# qmake CONFIG+=io_uring: write pages with io_uring (needs liburing)
+io_uring {
+  DEFINES += DOXY2MAN_IO_URING
+  LIBS += -luring
+}
 CONFIG += debug
 CONFIG += warn_off
 
 QMAKE_CXXFLAGS_DEBUG = -g -Wall -Wno-unused-parameter -Wno-switch
 
-HEADERS += main.h
+HEADERS += main.h roff_escape.h
 SOURCES += main.cc 
 
 doc.target = doxy2man.8
 doc.commands = asciidoc.py -v -d manpage -b docbook doxy2man.8.txt && xsltproc --nonet -o doxy2man.8 /usr/share/asciidoc/docbook-xsl/manpage.xsl doxy2man.8.xml
 QMAKE_EXTRA_TARGETS += doc
+
+bench.commands = bench/run.sh ./$(TARGET)
+bench.depends = $(TARGET)
+QMAKE_EXTRA_TARGETS += bench
+
+bench_escape.commands = bench/escape.sh
+QMAKE_EXTRA_TARGETS += bench_escape
+
+check.commands = bench/check.sh ./$(TARGET)
+check.depends = $(TARGET)
+QMAKE_EXTRA_TARGETS += check
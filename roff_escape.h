@@ -0,0 +1,165 @@
+/* Escaping of text for roff input.
+ *
+ * License: GPLv3+
+ *
+ */
+
+#ifndef ROFF_ESCAPE_H
+#define ROFF_ESCAPE_H
+
+#include <stddef.h>
+#include <string.h>
+
+// x86 builds get a SSE2 scanner (x86-64 always has SSE2) and, with GCC
+// or Clang, an AVX2 one as well that is selected at runtime when the CPU
+// supports it, i.e. no -mavx2 is needed. ROFF_ESCAPE_NO_AVX2 leaves out
+// the AVX2 one and ROFF_ESCAPE_SCALAR forces the plain loop, e.g. for
+// comparing them in bench/roff_escape_bench.cc.
+#if !defined(ROFF_ESCAPE_SCALAR) && defined(__SSE2__)
+#include <emmintrin.h>
+#define ROFF_ESCAPE_SSE2
+#if !defined(ROFF_ESCAPE_NO_AVX2) && defined(__GNUC__) \
+  && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define ROFF_ESCAPE_AVX2
+#endif
+#endif
+
+inline size_t roff_find_special_scalar(const char *p, size_t n)
+{
+  for (size_t i = 0; i < n; ++i)
+    if (p[i] == '\\' || p[i] == '\n')
+      return i;
+  return n;
+}
+
+#ifdef ROFF_ESCAPE_SSE2
+inline size_t roff_find_special_sse2(const char *p, size_t n)
+{
+  size_t i = 0;
+  const __m128i bs = _mm_set1_epi8('\\');
+  const __m128i nl = _mm_set1_epi8('\n');
+  // two vectors per iteration, i.e. one branch per 32 bytes
+  for (; i + 32 <= n; i += 32) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(p + i));
+    __m128i y = _mm_loadu_si128((const __m128i*)(p + i + 16));
+    unsigned m = _mm_movemask_epi8(_mm_or_si128(
+          _mm_cmpeq_epi8(x, bs), _mm_cmpeq_epi8(x, nl)))
+      | _mm_movemask_epi8(_mm_or_si128(
+          _mm_cmpeq_epi8(y, bs), _mm_cmpeq_epi8(y, nl))) << 16;
+    if (m)
+      return i + __builtin_ctz(m);
+  }
+  for (; i + 16 <= n; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(p + i));
+    unsigned m = _mm_movemask_epi8(_mm_or_si128(
+          _mm_cmpeq_epi8(x, bs), _mm_cmpeq_epi8(x, nl)));
+    if (m)
+      return i + __builtin_ctz(m);
+  }
+  return i + roff_find_special_scalar(p + i, n - i);
+}
+#endif
+
+#ifdef ROFF_ESCAPE_AVX2
+__attribute__((target("avx2")))
+inline size_t roff_find_special_avx2(const char *p, size_t n)
+{
+  size_t i = 0;
+  const __m256i bs = _mm256_set1_epi8('\\');
+  const __m256i nl = _mm256_set1_epi8('\n');
+  for (; i + 32 <= n; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(p + i));
+    unsigned m = _mm256_movemask_epi8(_mm256_or_si256(
+          _mm256_cmpeq_epi8(x, bs), _mm256_cmpeq_epi8(x, nl)));
+    if (m)
+      return i + __builtin_ctz(m);
+  }
+  return i + roff_find_special_sse2(p + i, n - i);
+}
+
+inline bool roff_has_avx2()
+{
+  static const bool r = __builtin_cpu_supports("avx2");
+  return r;
+}
+#endif
+
+/** Returns the offset of the first backslash or newline in [p, p+n), or n
+ *
+ * Those are the only bytes after which roff_escape() has to look closer,
+ * everything before is copied as is.
+ */
+inline size_t roff_find_special(const char *p, size_t n)
+{
+#ifdef ROFF_ESCAPE_AVX2
+  if (n >= 32 && roff_has_avx2())
+    return roff_find_special_avx2(p, n);
+#endif
+#ifdef ROFF_ESCAPE_SSE2
+  return roff_find_special_sse2(p, n);
+#else
+  return roff_find_special_scalar(p, n);
+#endif
+}
+
+inline bool roff_is_control(char c)
+{
+  return c == '.' || c == '\'';
+}
+
+/** Returns the offset of the first byte roff_escape() would change, or n
+ *
+ * bol: whether p is at the beginning of a line
+ */
+inline size_t roff_find_escape(const char *p, size_t n, bool bol)
+{
+  size_t i = 0;
+  for (;;) {
+    if (bol && i < n && roff_is_control(p[i]))
+      return i;
+    i += roff_find_special(p + i, n - i);
+    if (i == n || p[i] == '\\')
+      return i;
+    ++i;
+    bol = true;
+  }
+}
+
+/** Copies [p, p+n) escaped for roff to out, returns the end of the output
+ *
+ * A backslash becomes \e, a control character (. or ') at the beginning
+ * of a line is prefixed with the zero-width \&. bol is whether p is at
+ * the beginning of a line and it is updated for the next call. out must
+ * have room for 3*n bytes.
+ */
+inline char *roff_escape(const char *p, size_t n, char *out, bool &bol)
+{
+  const char *end = p + n;
+  while (p < end) {
+    if (bol && roff_is_control(*p)) {
+      *out++ = '\\';
+      *out++ = '&';
+    }
+    size_t k = roff_find_special(p, end - p);
+    memcpy(out, p, k);
+    out += k;
+    p += k;
+    if (p == end) {
+      bol = false;
+      break;
+    }
+    if (*p == '\\') {
+      *out++ = '\\';
+      *out++ = 'e';
+      bol = false;
+    } else {
+      *out++ = '\n';
+      bol = true;
+    }
+    ++p;
+  }
+  return out;
+}
+
+#endif